@@ -10,6 +10,17 @@
 #include <linux/mutex.h>
 #include <linux/uaccess.h>
 #include <linux/vmalloc.h>
+#include <linux/mm.h>
+#include <linux/rcupdate.h>
+#include <linux/idr.h>
+#include <linux/poll.h>
+#include <linux/wait.h>
+#include <linux/hashtable.h>
+#include <linux/jhash.h>
+#include <linux/crypto.h>
+#include <linux/workqueue.h>
+#include <linux/jiffies.h>
+#include <linux/capability.h>
 
 #include <lmod/meta.h>
 
@@ -24,7 +35,25 @@ MODULE_PARM_DESC(
 
 static int bufhub_clipboard_bcap = PAGE_SIZE;
 module_param_named(bcap, bufhub_clipboard_bcap, int, 0444);
-MODULE_PARM_DESC(bcap, "capacity for clipboard buffers");
+MODULE_PARM_DESC(bcap, "default capacity limit for clipboard buffers");
+
+static bool bufhub_dedup;
+module_param_named(dedup, bufhub_dedup, bool, 0644);
+MODULE_PARM_DESC(dedup, "share identical clipboard contents in memory");
+
+/* a week, well below the range of time_after() and msecs_to_jiffies() */
+#define BUFHUB_COMPRESS_AFTER_MAX (7 * 24 * 60 * 60)
+
+static int bufhub_compress_after;
+module_param_named(compress_after, bufhub_compress_after, int, 0444);
+MODULE_PARM_DESC(
+	compress_after,
+	"seconds without access after which clipboards are compressed, 0 = never"
+);
+
+static char *bufhub_compress_alg = "lz4";
+module_param_named(compress_alg, bufhub_compress_alg, charp, 0444);
+MODULE_PARM_DESC(compress_alg, "crypto compression algorithm to use");
 
 static int __init bufhub_check_module_params(void)
 {
@@ -35,6 +64,17 @@ static int __init bufhub_check_module_params(void)
 				bufhub_max_clipboards);
 		err = -EINVAL;
 	}
+	if (bufhub_clipboard_bcap <= 0) {
+		pr_err("bufhub_clipboard_bcap <= 0. value = %d\n",
+				bufhub_clipboard_bcap);
+		err = -EINVAL;
+	}
+	if (bufhub_compress_after < 0 ||
+			bufhub_compress_after > BUFHUB_COMPRESS_AFTER_MAX) {
+		pr_err("bufhub_compress_after out of range. value = %d\n",
+				bufhub_compress_after);
+		err = -EINVAL;
+	}
 	return err;
 }
 
@@ -54,9 +94,68 @@ struct bufhub_clipboard_dev {
 	spinlock_t master_lock; /* protects master */
 	struct device *dev;
 	struct kref kref;
+	struct bufhub_snapshot __rcu *snap;
+	/* protects drafts and publishing snap */
+	struct mutex buf_mutex;
+	/* how far drafts may grow */
+	size_t limit;
+	/* woken up when a new snapshot is published */
+	wait_queue_head_t waitq;
+	/* jiffies of the last open or publish, for compress_after */
+	unsigned long atime;
+	/* open readers, which pin a snapshot. protected by buf_mutex */
+	unsigned int nreaders;
+};
+
+/*
+ * clipboard contents. a snapshot is never modified once published, so
+ * readers pin the current one at open and read it without locking.
+ */
+struct bufhub_snapshot {
+	struct kref kref;
+	struct rcu_head rcu;
+	/* page aligned so it can be mapped to userspace. NULL if cap is 0 */
+	char *buf;
+	size_t cap;
+	size_t len;
+	/* bumped on each publish */
+	unsigned int gen;
+	/* owner of buf if it was deduplicated */
+	struct bufhub_shared *shared;
+	/* set instead of buf once compressed, only ever seen in dev->snap */
+	void *zbuf;
+	unsigned int zlen;
+};
+
+/*
+ * contents shared between identical snapshots when dedup is on. they stay
+ * hashed in bufhub_dedup_table as long as a snapshot uses them.
+ */
+struct bufhub_shared {
+	struct kref kref;
+	struct hlist_node hash_link;
+	u32 hash;
 	char *buf;
-	size_t buf_len;
-	struct mutex buf_mutex; /* protects buf, buf_len */
+	size_t cap;
+	size_t len;
+};
+
+static struct crypto_comp *bufhub_comp_tfm;
+static DEFINE_MUTEX(bufhub_comp_mutex); /* protects bufhub_comp_tfm */
+
+static DEFINE_HASHTABLE(bufhub_dedup_table, 8);
+static DEFINE_MUTEX(bufhub_dedup_mutex); /* protects bufhub_dedup_table */
+
+struct bufhub_clipboard_file {
+	struct bufhub_clipboard_dev *dev;
+	/* the pinned snapshot for readers, the draft for writers */
+	struct bufhub_snapshot *snap;
+	spinlock_t snap_lock; /* protects snap, readers may move it on */
+	/* a mapped draft cannot be moved to a bigger buffer */
+	atomic_t nmaps;
+	struct mutex map_mutex; /* protects snap->buf against nmaps */
+	/* the draft has to be published on close */
+	bool dirty;
 };
 
 #define bufhub_clipboard_dev_devt(bcdev) ((bcdev)->dev->devt)
@@ -64,12 +163,14 @@ struct bufhub_clipboard_dev {
 static inline int __must_check bufhub_clipboard_get(
 		struct bufhub_clipboard_dev *);
 static inline void bufhub_clipboard_put(struct bufhub_clipboard_dev *);
+static struct bufhub_clipboard_dev *bufhub_clipboard_lookup(unsigned int);
 
 static struct class *bufhub_clipboard_class;
 static int bufhub_clipboard_major;
 static char bufhub_clipboard_devname[] = KBUILD_MODNAME "_clipboard";
-static struct bufhub_clipboard_dev **bufhub_clipboard_ptrs;
-static DEFINE_SPINLOCK(bufhub_clipboard_ptrs_lock);
+/* maps minors to clipboards */
+static DEFINE_IDR(bufhub_clipboard_idr);
+static DEFINE_SPINLOCK(bufhub_clipboard_idr_lock); /* protects the idr */
 
 static int bufhub_clipboard_mutex_lock(struct mutex *mutex, int f_flags)
 {
@@ -81,122 +182,751 @@ static int bufhub_clipboard_mutex_lock(struct mutex *mutex, int f_flags)
 	return 0;
 }
 
+static struct bufhub_snapshot *bufhub_snapshot_alloc(size_t cap)
+{
+	struct bufhub_snapshot *snap;
+
+	snap = kmalloc(sizeof(*snap), GFP_KERNEL);
+	if (!snap)
+		return NULL;
+	snap->buf = NULL;
+	if (cap) {
+		snap->buf = vmalloc_user(PAGE_ALIGN(cap));
+		if (!snap->buf) {
+			kfree(snap);
+			return NULL;
+		}
+	}
+	kref_init(&snap->kref);
+	snap->cap = cap;
+	snap->len = 0;
+	snap->gen = 0;
+	snap->shared = NULL;
+	snap->zbuf = NULL;
+	snap->zlen = 0;
+	return snap;
+}
+
+/* called with bufhub_dedup_mutex held, releases it */
+static void bufhub_shared_kref_release(struct kref *kref)
+{
+	struct bufhub_shared *shared = container_of(kref,
+			struct bufhub_shared, kref);
+
+	hash_del(&shared->hash_link);
+	mutex_unlock(&bufhub_dedup_mutex);
+	vfree(shared->buf);
+	kfree(shared);
+}
+
+static inline void bufhub_shared_put(struct bufhub_shared *shared)
+{
+	kref_put_mutex(&shared->kref, bufhub_shared_kref_release,
+			&bufhub_dedup_mutex);
+}
+
+/*
+ * make a snapshot about to be published use the buffer of an identical one
+ * if there is any, or offer its own for sharing otherwise. the snapshot is
+ * left alone if sharing is not possible.
+ */
+static void bufhub_snapshot_dedup(struct bufhub_snapshot *snap)
+{
+	struct bufhub_shared *shared;
+	u32 hash;
+
+	if (!READ_ONCE(bufhub_dedup) || !snap->len)
+		return;
+	hash = jhash(snap->buf, snap->len, 0);
+	mutex_lock(&bufhub_dedup_mutex);
+	hash_for_each_possible(bufhub_dedup_table, shared, hash_link, hash) {
+		if (shared->hash != hash || shared->len != snap->len ||
+				memcmp(shared->buf, snap->buf, snap->len))
+			continue;
+		kref_get(&shared->kref);
+		mutex_unlock(&bufhub_dedup_mutex);
+		vfree(snap->buf);
+		snap->buf = shared->buf;
+		snap->cap = shared->cap;
+		snap->shared = shared;
+		return;
+	}
+	shared = kmalloc(sizeof(*shared), GFP_KERNEL);
+	if (shared) {
+		kref_init(&shared->kref);
+		shared->hash = hash;
+		shared->buf = snap->buf;
+		shared->cap = snap->cap;
+		shared->len = snap->len;
+		hash_add(bufhub_dedup_table, &shared->hash_link, hash);
+		snap->shared = shared;
+	}
+	mutex_unlock(&bufhub_dedup_mutex);
+}
+
+static void bufhub_snapshot_kref_release(struct kref *kref)
+{
+	struct bufhub_snapshot *snap = container_of(kref,
+			struct bufhub_snapshot, kref);
+
+	/* nobody gets to the contents without a reference */
+	if (snap->shared)
+		bufhub_shared_put(snap->shared);
+	else
+		vfree(snap->buf);
+	vfree(snap->zbuf);
+	/* a reader may still be in bufhub_snapshot_get_current() */
+	kfree_rcu(snap, rcu);
+}
+
+static inline void bufhub_snapshot_put(struct bufhub_snapshot *snap)
+{
+	kref_put(&snap->kref, bufhub_snapshot_kref_release);
+}
+
+/*
+ * replace the compressed snapshot zsnap of dev by a plain one. takes over
+ * the reference held on zsnap and returns the plain snapshot with one held.
+ */
+static struct bufhub_snapshot *bufhub_snapshot_inflate(
+		struct bufhub_clipboard_dev *dev, struct bufhub_snapshot *zsnap)
+{
+	struct bufhub_snapshot *snap;
+	unsigned int len;
+	int err;
+
+again:
+	mutex_lock(&dev->buf_mutex);
+	snap = rcu_dereference_protected(dev->snap,
+			lockdep_is_held(&dev->buf_mutex));
+	if (snap != zsnap) {
+		/* inflated by somebody else, or replaced by a writer */
+		kref_get(&snap->kref);
+		mutex_unlock(&dev->buf_mutex);
+		bufhub_snapshot_put(zsnap);
+		if (!snap->zbuf)
+			return snap;
+		zsnap = snap;
+		goto again;
+	}
+	snap = bufhub_snapshot_alloc(zsnap->len);
+	if (!snap) {
+		err = -ENOMEM;
+		goto fail;
+	}
+	len = zsnap->len;
+	mutex_lock(&bufhub_comp_mutex);
+	err = crypto_comp_decompress(bufhub_comp_tfm, zsnap->zbuf, zsnap->zlen,
+			(u8 *)snap->buf, &len);
+	mutex_unlock(&bufhub_comp_mutex);
+	if (!err && len != zsnap->len)
+		err = -EIO;
+	if (err) {
+		pr_err("<%s> failed to decompress %s err=%d\n", __func__,
+				dev_name(dev->dev), err);
+		bufhub_snapshot_put(snap);
+		goto fail;
+	}
+	snap->len = len;
+	snap->gen = zsnap->gen;
+	/* one for dev->snap, one for the caller */
+	kref_get(&snap->kref);
+	rcu_assign_pointer(dev->snap, snap);
+	mutex_unlock(&dev->buf_mutex);
+	/* the reference of dev->snap, then the one of the caller */
+	bufhub_snapshot_put(zsnap);
+	bufhub_snapshot_put(zsnap);
+	return snap;
+
+fail:
+	mutex_unlock(&dev->buf_mutex);
+	bufhub_snapshot_put(zsnap);
+	return ERR_PTR(err);
+}
+
+static struct bufhub_snapshot *bufhub_snapshot_get_current(
+		struct bufhub_clipboard_dev *dev)
+{
+	struct bufhub_snapshot *snap;
+
+	rcu_read_lock();
+	/* lost a race with a publish dropping the last reference, retry */
+	do {
+		snap = rcu_dereference(dev->snap);
+	} while (!kref_get_unless_zero(&snap->kref));
+	rcu_read_unlock();
+	WRITE_ONCE(dev->atime, jiffies);
+	if (snap->zbuf)
+		snap = bufhub_snapshot_inflate(dev, snap);
+	return snap;
+}
+
+/*
+ * compress the published snapshot of dev, unless a reader may have it
+ * pinned or it is shared, in which case compressing would not free
+ * anything.
+ */
+static void bufhub_clipboard_compress(struct bufhub_clipboard_dev *dev)
+{
+	struct bufhub_snapshot *snap, *zsnap;
+	unsigned int zlen;
+	void *scratch;
+	int err;
+
+	mutex_lock(&dev->buf_mutex);
+	snap = rcu_dereference_protected(dev->snap,
+			lockdep_is_held(&dev->buf_mutex));
+	if (!snap->len || snap->zbuf || snap->shared || dev->nreaders)
+		goto out;
+	zlen = snap->len;
+	scratch = vmalloc(zlen);
+	if (!scratch)
+		goto out;
+	mutex_lock(&bufhub_comp_mutex);
+	err = crypto_comp_compress(bufhub_comp_tfm, (const u8 *)snap->buf,
+			snap->len, scratch, &zlen);
+	mutex_unlock(&bufhub_comp_mutex);
+	/* fails when it would not fit, not worth it either way */
+	if (err || zlen >= snap->len)
+		goto out_free_scratch;
+	zsnap = bufhub_snapshot_alloc(0);
+	if (!zsnap)
+		goto out_free_scratch;
+	zsnap->zbuf = vmalloc(zlen);
+	if (!zsnap->zbuf) {
+		bufhub_snapshot_put(zsnap);
+		goto out_free_scratch;
+	}
+	memcpy(zsnap->zbuf, scratch, zlen);
+	zsnap->zlen = zlen;
+	zsnap->len = snap->len;
+	zsnap->gen = snap->gen;
+	rcu_assign_pointer(dev->snap, zsnap);
+	mutex_unlock(&dev->buf_mutex);
+	vfree(scratch);
+	bufhub_snapshot_put(snap);
+	return;
+
+out_free_scratch:
+	vfree(scratch);
+out:
+	mutex_unlock(&dev->buf_mutex);
+}
+
+static void bufhub_snapshot_publish(struct bufhub_clipboard_dev *dev,
+		struct bufhub_snapshot *snap)
+{
+	struct bufhub_snapshot *old;
+
+	/*
+	 * readers map the whole capacity, and with dedup possibly the buffer
+	 * of another clipboard, so don't leave anything cut off behind len
+	 */
+	if (snap->buf)
+		memset(snap->buf + snap->len, 0,
+				PAGE_ALIGN(snap->cap) - snap->len);
+	bufhub_snapshot_dedup(snap);
+	mutex_lock(&dev->buf_mutex);
+	old = rcu_dereference_protected(dev->snap,
+			lockdep_is_held(&dev->buf_mutex));
+	snap->gen = old->gen + 1;
+	rcu_assign_pointer(dev->snap, snap);
+	WRITE_ONCE(dev->atime, jiffies);
+	mutex_unlock(&dev->buf_mutex);
+	bufhub_snapshot_put(old);
+	wake_up_interruptible_poll(&dev->waitq, POLLIN | POLLRDNORM);
+}
+
+static unsigned int bufhub_snapshot_current_gen(
+		struct bufhub_clipboard_dev *dev)
+{
+	unsigned int gen;
+
+	rcu_read_lock();
+	gen = rcu_dereference(dev->snap)->gen;
+	rcu_read_unlock();
+	return gen;
+}
+
+static struct bufhub_snapshot *bufhub_clipboard_file_snap(
+		struct bufhub_clipboard_file *cfile)
+{
+	struct bufhub_snapshot *snap;
+
+	spin_lock(&cfile->snap_lock);
+	snap = cfile->snap;
+	kref_get(&snap->kref);
+	spin_unlock(&cfile->snap_lock);
+	return snap;
+}
+
+/* move a reader on to the current snapshot */
+static int bufhub_clipboard_file_refresh(struct bufhub_clipboard_file *cfile)
+{
+	struct bufhub_snapshot *snap;
+
+	snap = bufhub_snapshot_get_current(cfile->dev);
+	if (IS_ERR(snap))
+		return PTR_ERR(snap);
+	spin_lock(&cfile->snap_lock);
+	swap(snap, cfile->snap);
+	spin_unlock(&cfile->snap_lock);
+	bufhub_snapshot_put(snap);
+	return 0;
+}
+
+/*
+ * grow the draft of cfile to hold at least size bytes, up to the limit of
+ * the clipboard. called with buf_mutex held.
+ */
+static int bufhub_clipboard_reserve(struct bufhub_clipboard_file *cfile,
+		size_t size)
+{
+	struct bufhub_snapshot *snap = cfile->snap;
+	size_t limit = READ_ONCE(cfile->dev->limit);
+	size_t cap;
+	char *buf;
+	int err = 0;
+
+	if (size <= snap->cap)
+		return 0;
+	if (size > limit)
+		return -ENOSPC;
+	cap = min_t(size_t, PAGE_ALIGN(max(size, 2 * snap->cap)), limit);
+	buf = vmalloc_user(PAGE_ALIGN(cap));
+	if (!buf)
+		return -ENOMEM;
+	mutex_lock(&cfile->map_mutex);
+	/* existing mappings would be left behind on the old buffer */
+	if (atomic_read(&cfile->nmaps)) {
+		err = -EBUSY;
+		goto out;
+	}
+	if (snap->len)
+		memcpy(buf, snap->buf, snap->len);
+	swap(buf, snap->buf);
+	snap->cap = cap;
+out:
+	mutex_unlock(&cfile->map_mutex);
+	vfree(buf);
+	return err;
+}
+
 static ssize_t bufhub_clipboard_read(struct file *filp,
 		char __user *buf, size_t count, loff_t *ppos)
 {
-	struct bufhub_clipboard_dev *dev = filp->private_data;
+	struct bufhub_clipboard_file *cfile = filp->private_data;
+	struct bufhub_snapshot *snap = bufhub_clipboard_file_snap(cfile);
+	int draft = filp->f_mode & FMODE_WRITE;
 	ssize_t ret;
 
-	ret = bufhub_clipboard_mutex_lock(&dev->buf_mutex, filp->f_flags);
-	if (ret)
-		return ret;
-	count = min(count, (size_t)(dev->buf_len - *ppos));
-	ret = copy_to_user(buf, (dev->buf + *ppos), count);
-	if (ret)
+	/* published snapshots never change, only drafts need the lock */
+	if (draft) {
+		ret = bufhub_clipboard_mutex_lock(&cfile->dev->buf_mutex,
+				filp->f_flags);
+		if (ret)
+			goto out_put;
+	}
+	/* len may have been cut below the file offset */
+	if (*ppos >= snap->len)
+		count = 0;
+	count = min(count, (size_t)(snap->len - *ppos));
+	if (copy_to_user(buf, (snap->buf + *ppos), count)) {
+		ret = -EFAULT;
 		goto out;
+	}
 	*ppos += count;
 	ret = count;
 out:
-	mutex_unlock(&dev->buf_mutex);
+	if (draft)
+		mutex_unlock(&cfile->dev->buf_mutex);
+out_put:
+	bufhub_snapshot_put(snap);
 	return ret;
 }
 
 static ssize_t bufhub_clipboard_write(struct file *filp,
 		const char __user *buf, size_t count, loff_t *ppos)
 {
-	struct bufhub_clipboard_dev *dev = filp->private_data;
+	struct bufhub_clipboard_file *cfile = filp->private_data;
+	struct bufhub_snapshot *snap = cfile->snap;
+	size_t limit = READ_ONCE(cfile->dev->limit);
 	ssize_t ret;
 
-	if (*ppos >= bufhub_clipboard_bcap)
+	if (*ppos >= max(limit, snap->cap))
 		return -ENOSPC;
-	ret = bufhub_clipboard_mutex_lock(&dev->buf_mutex, filp->f_flags);
+	ret = bufhub_clipboard_mutex_lock(&cfile->dev->buf_mutex,
+			filp->f_flags);
 	if (ret)
 		return ret;
-	count = min(count, (size_t)(bufhub_clipboard_bcap - *ppos));
-	ret = copy_from_user((dev->buf + *ppos), buf, count);
+	count = min(count, (size_t)(max(limit, snap->cap) - *ppos));
+	ret = bufhub_clipboard_reserve(cfile, *ppos + count);
 	if (ret)
 		goto out;
+	if (copy_from_user((snap->buf + *ppos), buf, count)) {
+		ret = -EFAULT;
+		goto out;
+	}
 	ret = count;
 	*ppos += count;
-	dev->buf_len = max_t(size_t, dev->buf_len, *ppos);
+	snap->len = max_t(size_t, snap->len, *ppos);
+	cfile->dirty = true;
 out:
-	mutex_unlock(&dev->buf_mutex);
+	mutex_unlock(&cfile->dev->buf_mutex);
 	return ret;
 }
 
+static void bufhub_clipboard_vm_open(struct vm_area_struct *vma)
+{
+	struct bufhub_clipboard_file *cfile = vma->vm_private_data;
+
+	atomic_inc(&cfile->nmaps);
+}
+
+static void bufhub_clipboard_vm_close(struct vm_area_struct *vma)
+{
+	struct bufhub_clipboard_file *cfile = vma->vm_private_data;
+
+	atomic_dec(&cfile->nmaps);
+}
+
+static const struct vm_operations_struct bufhub_clipboard_vm_ops = {
+	.open = bufhub_clipboard_vm_open,
+	.close = bufhub_clipboard_vm_close,
+};
+
+/*
+ * the whole capacity can be mapped. readers get a read only mapping of the
+ * snapshot they opened, and writers map their draft, growing it first with
+ * BUFHUB_CLIPBOARD_IOCSLEN and setting the final length after filling it in
+ * place. drafts cannot grow while they are mapped.
+ *
+ * buf_mutex is not taken here, since writes fault on mmap_sem while holding
+ * it.
+ */
+static int bufhub_clipboard_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+	struct bufhub_clipboard_file *cfile = filp->private_data;
+	struct bufhub_snapshot *snap = bufhub_clipboard_file_snap(cfile);
+	int err;
+
+	mutex_lock(&cfile->map_mutex);
+	if (!snap->buf) {
+		err = -EINVAL;
+		goto out;
+	}
+	err = remap_vmalloc_range(vma, snap->buf, vma->vm_pgoff);
+	if (err)
+		goto out;
+	vma->vm_ops = &bufhub_clipboard_vm_ops;
+	vma->vm_private_data = cfile;
+	atomic_inc(&cfile->nmaps);
+	/* the draft may be changed in place from now on */
+	if (vma->vm_flags & VM_WRITE)
+		WRITE_ONCE(cfile->dirty, true);
+out:
+	mutex_unlock(&cfile->map_mutex);
+	/* the mapping keeps the pages */
+	bufhub_snapshot_put(snap);
+	return err;
+}
+
+static long bufhub_clipboard_ioctl_IOCSLEN(struct bufhub_clipboard_file *cfile,
+		int f_flags, const unsigned int __user *uptr)
+{
+	unsigned int len;
+	int err;
+
+	err = get_user(len, uptr);
+	if (err)
+		return err;
+	err = bufhub_clipboard_mutex_lock(&cfile->dev->buf_mutex, f_flags);
+	if (err)
+		return err;
+	err = bufhub_clipboard_reserve(cfile, len);
+	if (err == -ENOSPC)
+		err = -EINVAL;
+	if (!err) {
+		cfile->snap->len = len;
+		cfile->dirty = true;
+	}
+	mutex_unlock(&cfile->dev->buf_mutex);
+	return err;
+}
+
+static long bufhub_clipboard_ioctl(struct file *filp,
+		unsigned int cmd, unsigned long arg)
+{
+	struct bufhub_clipboard_file *cfile = filp->private_data;
+	struct bufhub_snapshot *snap;
+	long ret = 0;
+
+	if ((_IOC_TYPE(cmd) != BUFHUB_CLIPBOARD_IOC_MAGIC) ||
+			(_IOC_NR(cmd) > BUFHUB_CLIPBOARD_IOC_MAXNR))
+		return -ENOTTY;
+	switch (cmd) {
+	case BUFHUB_CLIPBOARD_IOCGLEN:
+		snap = bufhub_clipboard_file_snap(cfile);
+		ret = put_user((unsigned int)READ_ONCE(snap->len),
+				(unsigned int __user *)arg);
+		bufhub_snapshot_put(snap);
+		break;
+	case BUFHUB_CLIPBOARD_IOCGGEN:
+		snap = bufhub_clipboard_file_snap(cfile);
+		ret = put_user(snap->gen, (unsigned int __user *)arg);
+		bufhub_snapshot_put(snap);
+		break;
+	case BUFHUB_CLIPBOARD_IOCSLEN:
+		if (!(filp->f_mode & FMODE_WRITE))
+			return -EBADF;
+		ret = bufhub_clipboard_ioctl_IOCSLEN(cfile, filp->f_flags,
+				(const unsigned int __user *)arg);
+		break;
+	default:
+		ret = -ENOTTY;
+	}
+	return ret;
+}
+
+/*
+ * writers build a private draft that replaces the published snapshot when
+ * they close, unless they left it untouched. O_RDWR drafts start as a copy of the current contents, O_WRONLY
+ * drafts start empty. either way there is room for a page to begin with,
+ * and writes grow it up to the limit.
+ */
+static struct bufhub_snapshot *bufhub_clipboard_draft(
+		struct bufhub_clipboard_dev *dev, struct file *filp)
+{
+	struct bufhub_snapshot *draft, *cur = NULL;
+	size_t cap = min_t(size_t, PAGE_SIZE, READ_ONCE(dev->limit));
+
+	if (filp->f_mode & FMODE_READ) {
+		cur = bufhub_snapshot_get_current(dev);
+		if (IS_ERR(cur))
+			return cur;
+		cap = max(cap, cur->len);
+	}
+	draft = bufhub_snapshot_alloc(cap);
+	if (draft && cur && cur->len) {
+		memcpy(draft->buf, cur->buf, cur->len);
+		draft->len = cur->len;
+	}
+	if (cur)
+		bufhub_snapshot_put(cur);
+	return draft ? draft : ERR_PTR(-ENOMEM);
+}
+
+static void bufhub_clipboard_nreaders_add(struct bufhub_clipboard_dev *dev,
+		int n)
+{
+	mutex_lock(&dev->buf_mutex);
+	dev->nreaders += n;
+	mutex_unlock(&dev->buf_mutex);
+}
+
 static int bufhub_clipboard_open(struct inode *inode, struct file *filp)
 {
-	unsigned int minor = iminor(inode);
-	struct bufhub_clipboard_dev *dev = bufhub_clipboard_ptrs[minor];
+	struct bufhub_clipboard_dev *dev;
+	struct bufhub_clipboard_file *cfile;
+	int err;
 
-	if (!bufhub_clipboard_get(dev)) {
-		pr_err("<%s> bufhub_clipboard_get failed\n", __func__);
+	dev = bufhub_clipboard_lookup(iminor(inode));
+	if (!dev) {
+		pr_err("<%s> bufhub_clipboard_lookup failed\n", __func__);
 		return -ENODEV;
 	}
-	filp->private_data = dev;
-	if ((filp->f_flags & O_ACCMODE) == O_WRONLY) {
-		int err = bufhub_clipboard_mutex_lock(&dev->buf_mutex,
-				filp->f_flags);
-		if (err) {
-			bufhub_clipboard_put(dev);
-			return err;
-		}
-		dev->buf_len = 0;
-		mutex_unlock(&dev->buf_mutex);
+	cfile = kmalloc(sizeof(*cfile), GFP_KERNEL);
+	if (!cfile) {
+		err = -ENOMEM;
+		goto fail_kmalloc_cfile;
+	}
+	cfile->dev = dev;
+	atomic_set(&cfile->nmaps, 0);
+	mutex_init(&cfile->map_mutex);
+	spin_lock_init(&cfile->snap_lock);
+	/* O_WRONLY empties the clipboard even if nothing is written */
+	cfile->dirty = (filp->f_mode & FMODE_WRITE) &&
+			!(filp->f_mode & FMODE_READ);
+	if (filp->f_mode & FMODE_WRITE) {
+		cfile->snap = bufhub_clipboard_draft(dev, filp);
+	} else {
+		/* counted first, so the snapshot isn't compressed under us */
+		bufhub_clipboard_nreaders_add(dev, 1);
+		cfile->snap = bufhub_snapshot_get_current(dev);
+	}
+	if (IS_ERR(cfile->snap)) {
+		err = PTR_ERR(cfile->snap);
+		goto fail_snap;
 	}
+	filp->private_data = cfile;
 	return 0;
+
+fail_snap:
+	if (!(filp->f_mode & FMODE_WRITE))
+		bufhub_clipboard_nreaders_add(dev, -1);
+	kfree(cfile);
+fail_kmalloc_cfile:
+	bufhub_clipboard_put(dev);
+	return err;
 }
 
 static int bufhub_clipboard_release(struct inode *inode, struct file *filp)
 {
-	struct bufhub_clipboard_dev *dev = filp->private_data;
-
+	struct bufhub_clipboard_file *cfile = filp->private_data;
+	struct bufhub_clipboard_dev *dev = cfile->dev;
+
+	/* untouched drafts would only bump the generation */
+	if (cfile->dirty)
+		bufhub_snapshot_publish(dev, cfile->snap);
+	else
+		bufhub_snapshot_put(cfile->snap);
+	if (!(filp->f_mode & FMODE_WRITE))
+		bufhub_clipboard_nreaders_add(dev, -1);
 	filp->private_data = NULL;
+	kfree(cfile);
 	bufhub_clipboard_put(dev);
 	return 0;
 }
 
+/*
+ * readers that seek back to the start with SEEK_SET move on to the latest
+ * snapshot, so they can reread the clipboard after poll reported a change.
+ * other seeks, including position queries, keep the pinned snapshot.
+ */
+static loff_t bufhub_clipboard_llseek(struct file *filp, loff_t off,
+		int whence)
+{
+	loff_t pos = default_llseek(filp, off, whence);
+	int err;
+
+	if (pos == 0 && whence == SEEK_SET && !(filp->f_mode & FMODE_WRITE)) {
+		err = bufhub_clipboard_file_refresh(filp->private_data);
+		if (err)
+			return err;
+	}
+	return pos;
+}
+
+/*
+ * readers are readable once a snapshot newer than theirs is published.
+ * drafts are always writable.
+ */
+static unsigned int bufhub_clipboard_poll(struct file *filp, poll_table *wait)
+{
+	struct bufhub_clipboard_file *cfile = filp->private_data;
+	struct bufhub_snapshot *snap;
+	unsigned int mask = 0;
+
+	if (filp->f_mode & FMODE_WRITE)
+		return POLLOUT | POLLWRNORM;
+	poll_wait(filp, &cfile->dev->waitq, wait);
+	snap = bufhub_clipboard_file_snap(cfile);
+	if (snap->gen != bufhub_snapshot_current_gen(cfile->dev))
+		mask |= POLLIN | POLLRDNORM;
+	bufhub_snapshot_put(snap);
+	return mask;
+}
+
 static const struct file_operations bufhub_clipboard_fops = {
 	.owner = THIS_MODULE,
-	.llseek = default_llseek,
+	.llseek = bufhub_clipboard_llseek,
+	.poll = bufhub_clipboard_poll,
 	.read = bufhub_clipboard_read,
 	.write = bufhub_clipboard_write,
+	.mmap = bufhub_clipboard_mmap,
+	.unlocked_ioctl = bufhub_clipboard_ioctl,
 	.open = bufhub_clipboard_open,
 	.release = bufhub_clipboard_release,
 };
 
+static void bufhub_clipboard_device_release(struct device *dev)
+{
+	kfree(dev);
+}
+
+/*
+ * like device_create(), but can hold back the KOBJ_ADD uevent for callers
+ * creating clipboards in bulk. they send it with bufhub_clipboard_uevent()
+ * once they are done.
+ */
+static struct device *bufhub_clipboard_device_create(
+		struct bufhub_clipboard_dev *dev, dev_t devno,
+		bool defer_uevent)
+{
+	struct device *device;
+	int err;
+
+	device = kzalloc(sizeof(*device), GFP_KERNEL);
+	if (!device)
+		return ERR_PTR(-ENOMEM);
+	device_initialize(device);
+	device->devt = devno;
+	device->class = bufhub_clipboard_class;
+	device->release = bufhub_clipboard_device_release;
+	dev_set_drvdata(device, dev);
+	dev_set_uevent_suppress(device, defer_uevent);
+	err = dev_set_name(device, "%s%d", bufhub_clipboard_devname,
+			MINOR(devno));
+	if (err)
+		goto fail;
+	err = device_add(device);
+	if (err)
+		goto fail;
+	return device;
+fail:
+	put_device(device);
+	return ERR_PTR(err);
+}
+
+static void bufhub_clipboard_uevent(struct bufhub_clipboard_dev *dev)
+{
+	dev_set_uevent_suppress(dev->dev, false);
+	kobject_uevent(&dev->dev->kobj, KOBJ_ADD);
+}
+
 static struct bufhub_clipboard_dev *bufhub_clipboard_create(
-		struct bufhub_master *master)
+		struct bufhub_master *master, bool defer_uevent)
 {
-	unsigned int i;
+	int i;
 	int err = 0;
 	unsigned long flags;
 	struct bufhub_clipboard_dev *dev;
+	struct bufhub_snapshot *snap;
 	dev_t devno;
 
-	dev = kzalloc(sizeof(*dev) + bufhub_clipboard_bcap, GFP_KERNEL);
+	dev = kzalloc(sizeof(*dev), GFP_KERNEL);
 	if (!dev) {
 		err = -ENOMEM;
 		pr_err("<%s> failed to allocate dev\n", __func__);
 		goto fail_kzalloc_dev;
-		return ERR_PTR(-ENODEV);
 	}
-
-	spin_lock_irqsave(&bufhub_clipboard_ptrs_lock, flags);
-	for (i = 0; i < bufhub_max_clipboards && bufhub_clipboard_ptrs[i]; i++)
-		;
-	if (i == bufhub_max_clipboards) {
-		err = -ENODEV;
+	/* nothing is allocated until something is written */
+	snap = bufhub_snapshot_alloc(0);
+	if (!snap) {
+		err = -ENOMEM;
+		pr_err("<%s> failed to allocate snapshot\n", __func__);
+		goto fail_snapshot_alloc;
+	}
+	RCU_INIT_POINTER(dev->snap, snap);
+
+	/* reserve a minor, the clipboard is only published once complete */
+	idr_preload(GFP_KERNEL);
+	spin_lock_irqsave(&bufhub_clipboard_idr_lock, flags);
+	i = idr_alloc(&bufhub_clipboard_idr, NULL, 0, bufhub_max_clipboards,
+			GFP_NOWAIT);
+	spin_unlock_irqrestore(&bufhub_clipboard_idr_lock, flags);
+	idr_preload_end();
+	if (i < 0) {
+		err = (i == -ENOSPC) ? -ENODEV : i;
 		pr_err("<%s> all clipboards are occupied\n", __func__);
-		spin_unlock_irqrestore(&bufhub_clipboard_ptrs_lock, flags);
-		goto fail_find_minor;
+		goto fail_idr_alloc;
 	}
-	bufhub_clipboard_ptrs[i] = dev;
-	spin_unlock_irqrestore(&bufhub_clipboard_ptrs_lock, flags);
 	devno = MKDEV(bufhub_clipboard_major, i);
 
-	dev->buf = (void *)(dev + 1);
 	mutex_init(&dev->buf_mutex);
+	dev->limit = bufhub_clipboard_bcap;
+	init_waitqueue_head(&dev->waitq);
+	dev->atime = jiffies;
 	spin_lock_init(&dev->master_lock);
 	dev->master = master;
 	INIT_LIST_HEAD(&dev->slave_link);
@@ -204,11 +934,10 @@ static struct bufhub_clipboard_dev *bufhub_clipboard_create(
 	/* block io operations until everything is in place */
 	mutex_lock(&dev->buf_mutex);
 
-	dev->dev = device_create(bufhub_clipboard_class, NULL, devno, dev,
-			"%s%d", bufhub_clipboard_devname, i);
+	dev->dev = bufhub_clipboard_device_create(dev, devno, defer_uevent);
 	if (IS_ERR(dev->dev)) {
 		err = PTR_ERR(dev->dev);
-		pr_err("<%s> device_create failed err=%d\n", __func__, err);
+		pr_err("<%s> device creation failed err=%d\n", __func__, err);
 		goto fail_device_create;
 	}
 
@@ -216,16 +945,22 @@ static struct bufhub_clipboard_dev *bufhub_clipboard_create(
 	list_add(&dev->slave_link, &dev->master->slaves_list);
 	spin_unlock_irqrestore(&dev->master->slaves_list_lock, flags);
 
+	spin_lock_irqsave(&bufhub_clipboard_idr_lock, flags);
+	idr_replace(&bufhub_clipboard_idr, dev, i);
+	spin_unlock_irqrestore(&bufhub_clipboard_idr_lock, flags);
+
 	mutex_unlock(&dev->buf_mutex);
 	pr_info("created clipboard %s successfully\n", dev_name(dev->dev));
 	return dev;
 
 fail_device_create:
 	mutex_unlock(&dev->buf_mutex);
-	spin_lock_irqsave(&bufhub_clipboard_ptrs_lock, flags);
-	bufhub_clipboard_ptrs[i] = NULL;
-	spin_unlock_irqrestore(&bufhub_clipboard_ptrs_lock, flags);
-fail_find_minor:
+	spin_lock_irqsave(&bufhub_clipboard_idr_lock, flags);
+	idr_remove(&bufhub_clipboard_idr, i);
+	spin_unlock_irqrestore(&bufhub_clipboard_idr_lock, flags);
+fail_idr_alloc:
+	bufhub_snapshot_put(snap);
+fail_snapshot_alloc:
 	kfree(dev);
 fail_kzalloc_dev:
 	return ERR_PTR(err);
@@ -237,6 +972,20 @@ static inline int __must_check bufhub_clipboard_get(
 	return kref_get_unless_zero(&dev->kref);
 }
 
+/* returns the clipboard with a reference held, or NULL */
+static struct bufhub_clipboard_dev *bufhub_clipboard_lookup(unsigned int minor)
+{
+	struct bufhub_clipboard_dev *dev;
+	unsigned long flags;
+
+	spin_lock_irqsave(&bufhub_clipboard_idr_lock, flags);
+	dev = idr_find(&bufhub_clipboard_idr, minor);
+	if (dev && !bufhub_clipboard_get(dev))
+		dev = NULL;
+	spin_unlock_irqrestore(&bufhub_clipboard_idr_lock, flags);
+	return dev;
+}
+
 static void bufhub_clipboard_destroy(struct bufhub_clipboard_dev *dev)
 {
 	unsigned long flags, flags2;
@@ -254,10 +1003,11 @@ static void bufhub_clipboard_destroy(struct bufhub_clipboard_dev *dev)
 	spin_unlock_irqrestore(&dev->master_lock, flags);
 	device_destroy(bufhub_clipboard_class, devno);
 
-	spin_lock_irqsave(&bufhub_clipboard_ptrs_lock, flags);
-	bufhub_clipboard_ptrs[MINOR(devno)] = NULL;
-	spin_unlock_irqrestore(&bufhub_clipboard_ptrs_lock, flags);
+	spin_lock_irqsave(&bufhub_clipboard_idr_lock, flags);
+	idr_remove(&bufhub_clipboard_idr, MINOR(devno));
+	spin_unlock_irqrestore(&bufhub_clipboard_idr_lock, flags);
 
+	bufhub_snapshot_put(rcu_dereference_protected(dev->snap, 1));
 	kfree(dev);
 }
 
@@ -323,7 +1073,7 @@ static struct bufhub_clipboard_dev *bufhub_miscdev_ioctl_create(
 	struct bufhub_clipboard_dev *dev;
 	unsigned int minor;
 
-	dev = bufhub_clipboard_create(master);
+	dev = bufhub_clipboard_create(master, false);
 	if (IS_ERR(dev)) {
 		err = PTR_ERR(dev);
 		goto out;
@@ -336,52 +1086,193 @@ out:
 	return dev;
 }
 
-struct bufhub_clipboard_match {
-	unsigned int minor;
-	struct bufhub_clipboard_dev *dev;
-};
-
-static int bufhub_clipboard_match(struct device *dev, void *data)
+/*
+ * find a clipboard of master by its minor. returns it with a reference
+ * held, to be dropped with bufhub_clipboard_put().
+ */
+static struct bufhub_clipboard_dev *bufhub_master_find(
+		struct bufhub_master *master, unsigned int minor)
 {
-	struct bufhub_clipboard_match *match = data;
+	struct bufhub_clipboard_dev *dev;
+	int err = 0;
+	unsigned long flags;
 
-	if (MINOR(dev->devt) == match->minor) {
-		match->dev = dev_get_drvdata(dev);
-		return -1;
+	dev = bufhub_clipboard_lookup(minor);
+	if (!dev) {
+		pr_err("<%s> nonexisting clipboard %s%d\n",
+				__func__, bufhub_clipboard_devname, minor);
+		return ERR_PTR(-EINVAL);
 	}
-	return 0;
+	spin_lock_irqsave(&dev->master_lock, flags);
+	if (master != dev->master)
+		err = -EPERM;
+	spin_unlock_irqrestore(&dev->master_lock, flags);
+	if (err) {
+		pr_err("<%s> invalid master for clipboard %s\n",
+				__func__, dev_name(dev->dev));
+		bufhub_clipboard_put(dev);
+		return ERR_PTR(err);
+	}
+	return dev;
 }
 
 static int bufhub_miscdev_ioctl_destroy(
 		struct bufhub_master *master, const unsigned int __user *uptr)
 {
-	struct bufhub_clipboard_match match;
+	struct bufhub_clipboard_dev *dev;
+	unsigned int minor;
 	int err;
-	unsigned long flags;
 
-	err = get_user(match.minor, uptr);
+	err = get_user(minor, uptr);
 	if (err)
 		return err;
-	match.dev = NULL;
-	class_for_each_device(bufhub_clipboard_class, NULL, &match,
-			bufhub_clipboard_match);
-	if (!match.dev) {
-		err = -EINVAL;
-		pr_err("<%s> cannot destroy nonexisting clipboard %s%d\n",
-				__func__, bufhub_clipboard_devname,
-				match.minor);
-		return err;
+	dev = bufhub_master_find(master, minor);
+	if (IS_ERR(dev))
+		return PTR_ERR(dev);
+	/* the reference of the master, then the one from the lookup */
+	bufhub_clipboard_put(dev);
+	bufhub_clipboard_put(dev);
+	return 0;
+}
+
+/*
+ * creates up to batch.count clipboards, with their uevents sent only after
+ * all of them exist. returns how many were created, their minors are
+ * copied to batch.minors.
+ */
+static long bufhub_miscdev_ioctl_IOCCREATEV(
+		struct bufhub_master *master,
+		const struct bufhub_batch __user *uptr)
+{
+	struct bufhub_batch batch;
+	struct bufhub_clipboard_dev **devs;
+	unsigned int *minors;
+	unsigned int i, n;
+	long ret = 0;
+
+	if (copy_from_user(&batch, uptr, sizeof(batch)))
+		return -EFAULT;
+	if (batch.pad)
+		return -EINVAL;
+	if (!batch.count)
+		return 0;
+	/* no point in trying for more than can exist */
+	batch.count = min_t(unsigned int, batch.count, bufhub_max_clipboards);
+	devs = kmalloc_array(batch.count, sizeof(*devs), GFP_KERNEL);
+	minors = kmalloc_array(batch.count, sizeof(*minors), GFP_KERNEL);
+	if (!devs || !minors) {
+		ret = -ENOMEM;
+		goto out_free;
 	}
-	spin_lock_irqsave(&match.dev->master_lock, flags);
-	if (master != match.dev->master)
-		err = -EPERM;
-	spin_unlock_irqrestore(&match.dev->master_lock, flags);
-	if (err) {
-		pr_err("<%s> invalid master to destroy clipboard %s\n",
-				__func__, dev_name(match.dev->dev));
-		return err;
+	for (n = 0; n < batch.count; n++) {
+		devs[n] = bufhub_clipboard_create(master, true);
+		if (IS_ERR(devs[n])) {
+			ret = PTR_ERR(devs[n]);
+			break;
+		}
+		minors[n] = MINOR(bufhub_clipboard_dev_devt(devs[n]));
+	}
+	if (n && copy_to_user(u64_to_user_ptr(batch.minors), minors,
+			n * sizeof(*minors))) {
+		/* userspace would not know about them, undo */
+		for (i = 0; i < n; i++)
+			bufhub_clipboard_master_put(devs[i]);
+		ret = -EFAULT;
+		goto out_free;
 	}
-	bufhub_clipboard_put(match.dev);
+	for (i = 0; i < n; i++)
+		bufhub_clipboard_uevent(devs[i]);
+	if (n)
+		ret = n;
+out_free:
+	kfree(minors);
+	kfree(devs);
+	return ret;
+}
+
+/*
+ * destroys the clipboards in batch.minors, stopping at the first one that
+ * fails. returns how many were destroyed.
+ */
+static long bufhub_miscdev_ioctl_IOCDESTROYV(
+		struct bufhub_master *master,
+		const struct bufhub_batch __user *uptr)
+{
+	struct bufhub_batch batch;
+	struct bufhub_clipboard_dev *dev;
+	unsigned int *minors;
+	unsigned int n;
+	long ret = 0;
+
+	if (copy_from_user(&batch, uptr, sizeof(batch)))
+		return -EFAULT;
+	if (batch.pad)
+		return -EINVAL;
+	if (!batch.count)
+		return 0;
+	if (batch.count > bufhub_max_clipboards)
+		return -EINVAL;
+	minors = memdup_user(u64_to_user_ptr(batch.minors),
+			batch.count * sizeof(*minors));
+	if (IS_ERR(minors))
+		return PTR_ERR(minors);
+	for (n = 0; n < batch.count; n++) {
+		dev = bufhub_master_find(master, minors[n]);
+		if (IS_ERR(dev)) {
+			ret = PTR_ERR(dev);
+			break;
+		}
+		/* as in bufhub_miscdev_ioctl_destroy() */
+		bufhub_clipboard_put(dev);
+		bufhub_clipboard_put(dev);
+	}
+	if (n)
+		ret = n;
+	kfree(minors);
+	return ret;
+}
+
+static int bufhub_miscdev_ioctl_IOCGLIMIT(
+		struct bufhub_master *master, struct bufhub_limit __user *uptr)
+{
+	struct bufhub_clipboard_dev *dev;
+	struct bufhub_limit limit;
+
+	if (copy_from_user(&limit, uptr, sizeof(limit)))
+		return -EFAULT;
+	dev = bufhub_master_find(master, limit.minor);
+	if (IS_ERR(dev))
+		return PTR_ERR(dev);
+	limit.limit = READ_ONCE(dev->limit);
+	bufhub_clipboard_put(dev);
+	if (copy_to_user(uptr, &limit, sizeof(limit)))
+		return -EFAULT;
+	return 0;
+}
+
+/*
+ * lowering the limit does not shrink existing contents, it only stops
+ * drafts from growing past it. raising it above bcap takes
+ * CAP_SYS_RESOURCE.
+ */
+static int bufhub_miscdev_ioctl_IOCSLIMIT(
+		struct bufhub_master *master,
+		const struct bufhub_limit __user *uptr)
+{
+	struct bufhub_clipboard_dev *dev;
+	struct bufhub_limit limit;
+
+	if (copy_from_user(&limit, uptr, sizeof(limit)))
+		return -EFAULT;
+	if (!limit.limit)
+		return -EINVAL;
+	if (limit.limit > bufhub_clipboard_bcap && !capable(CAP_SYS_RESOURCE))
+		return -EPERM;
+	dev = bufhub_master_find(master, limit.minor);
+	if (IS_ERR(dev))
+		return PTR_ERR(dev);
+	WRITE_ONCE(dev->limit, limit.limit);
+	bufhub_clipboard_put(dev);
 	return 0;
 }
 
@@ -406,6 +1297,22 @@ static long bufhub_miscdev_ioctl(struct file *filp,
 		ret = bufhub_miscdev_ioctl_destroy(master,
 				(const unsigned int __user *)arg);
 		break;
+	case BUFHUB_IOCGLIMIT:
+		ret = bufhub_miscdev_ioctl_IOCGLIMIT(master,
+				(struct bufhub_limit __user *)arg);
+		break;
+	case BUFHUB_IOCSLIMIT:
+		ret = bufhub_miscdev_ioctl_IOCSLIMIT(master,
+				(const struct bufhub_limit __user *)arg);
+		break;
+	case BUFHUB_IOCCREATEV:
+		ret = bufhub_miscdev_ioctl_IOCCREATEV(master,
+				(const struct bufhub_batch __user *)arg);
+		break;
+	case BUFHUB_IOCDESTROYV:
+		ret = bufhub_miscdev_ioctl_IOCDESTROYV(master,
+				(const struct bufhub_batch __user *)arg);
+		break;
 	default:
 		ret = -ENOTTY;
 	}
@@ -425,6 +1332,77 @@ static struct miscdevice bufhub_miscdev = {
 	.fops = &bufhub_miscdev_fops,
 };
 
+static ssize_t raw_size_show(struct device *d,
+		struct device_attribute *attr, char *buf)
+{
+	struct bufhub_clipboard_dev *dev = dev_get_drvdata(d);
+	size_t len;
+
+	rcu_read_lock();
+	len = rcu_dereference(dev->snap)->len;
+	rcu_read_unlock();
+	return sprintf(buf, "%zu\n", len);
+}
+static DEVICE_ATTR_RO(raw_size);
+
+/* 0 while the clipboard is not compressed */
+static ssize_t compressed_size_show(struct device *d,
+		struct device_attribute *attr, char *buf)
+{
+	struct bufhub_clipboard_dev *dev = dev_get_drvdata(d);
+	unsigned int zlen;
+
+	rcu_read_lock();
+	zlen = rcu_dereference(dev->snap)->zlen;
+	rcu_read_unlock();
+	return sprintf(buf, "%u\n", zlen);
+}
+static DEVICE_ATTR_RO(compressed_size);
+
+static struct attribute *bufhub_clipboard_attrs[] = {
+	&dev_attr_raw_size.attr,
+	&dev_attr_compressed_size.attr,
+	NULL,
+};
+ATTRIBUTE_GROUPS(bufhub_clipboard);
+
+/* returns the first clipboard from *minor on with a reference held */
+static struct bufhub_clipboard_dev *bufhub_clipboard_lookup_next(int *minor)
+{
+	struct bufhub_clipboard_dev *dev;
+	unsigned long flags;
+
+	spin_lock_irqsave(&bufhub_clipboard_idr_lock, flags);
+	while ((dev = idr_get_next(&bufhub_clipboard_idr, minor)) &&
+			!bufhub_clipboard_get(dev))
+		(*minor)++;
+	spin_unlock_irqrestore(&bufhub_clipboard_idr_lock, flags);
+	return dev;
+}
+
+static void bufhub_compress_work_fn(struct work_struct *work);
+static DECLARE_DELAYED_WORK(bufhub_compress_work, bufhub_compress_work_fn);
+
+static inline unsigned long bufhub_compress_after_jiffies(void)
+{
+	return msecs_to_jiffies(bufhub_compress_after * MSEC_PER_SEC);
+}
+
+/* compresses the clipboards that went cold since the last run */
+static void bufhub_compress_work_fn(struct work_struct *work)
+{
+	unsigned long after = bufhub_compress_after_jiffies();
+	struct bufhub_clipboard_dev *dev;
+	int minor;
+
+	for (minor = 0; (dev = bufhub_clipboard_lookup_next(&minor)); minor++) {
+		if (time_after(jiffies, READ_ONCE(dev->atime) + after))
+			bufhub_clipboard_compress(dev);
+		bufhub_clipboard_put(dev);
+	}
+	schedule_delayed_work(&bufhub_compress_work, after);
+}
+
 static int __init bufhub_init(void)
 {
 	int err = 0;
@@ -433,16 +1411,15 @@ static int __init bufhub_init(void)
 	if (err)
 		return err;
 
-	bufhub_clipboard_ptrs = vmalloc(
-			sizeof(bufhub_clipboard_ptrs[0]) *
-					bufhub_max_clipboards);
-	if (!bufhub_clipboard_ptrs) {
-		pr_err("failed to allocate bufhub_clipboard_ptrs\n");
-		goto fail_vmalloc_bufhub_clipboard_ptrs;
+	if (bufhub_compress_after) {
+		bufhub_comp_tfm = crypto_alloc_comp(bufhub_compress_alg, 0, 0);
+		if (IS_ERR(bufhub_comp_tfm)) {
+			err = PTR_ERR(bufhub_comp_tfm);
+			pr_err("crypto_alloc_comp %s failed. err = %d\n",
+					bufhub_compress_alg, err);
+			goto fail_crypto_alloc_comp;
+		}
 	}
-	memset(bufhub_clipboard_ptrs, 0,
-			sizeof(bufhub_clipboard_ptrs[0]) *
-					bufhub_max_clipboards);
 
 	bufhub_clipboard_major = __register_chrdev(0, 0, bufhub_max_clipboards,
 			KBUILD_MODNAME, &bufhub_clipboard_fops);
@@ -459,6 +1436,7 @@ static int __init bufhub_init(void)
 		pr_err("class_create failed. err = %d\n", err);
 		goto fail_class_create;
 	}
+	bufhub_clipboard_class->dev_groups = bufhub_clipboard_groups;
 
 	err = misc_register(&bufhub_miscdev);
 	if (err) {
@@ -466,6 +1444,10 @@ static int __init bufhub_init(void)
 		goto fail_misc_register;
 	}
 
+	if (bufhub_compress_after)
+		schedule_delayed_work(&bufhub_compress_work,
+				bufhub_compress_after_jiffies());
+
 	pr_info("initializated successfully\n");
 	return 0;
 
@@ -476,19 +1458,23 @@ fail_class_create:
 	__unregister_chrdev(bufhub_clipboard_major, 0, bufhub_max_clipboards,
 			KBUILD_MODNAME);
 fail_register_chrdev:
-	vfree(bufhub_clipboard_ptrs);
-fail_vmalloc_bufhub_clipboard_ptrs:
+	if (bufhub_comp_tfm)
+		crypto_free_comp(bufhub_comp_tfm);
+fail_crypto_alloc_comp:
 	return err;
 }
 module_init(bufhub_init);
 
 static void __exit bufhub_exit(void)
 {
+	cancel_delayed_work_sync(&bufhub_compress_work);
 	misc_deregister(&bufhub_miscdev);
 	class_destroy(bufhub_clipboard_class);
 	__unregister_chrdev(bufhub_clipboard_major, 0, bufhub_max_clipboards,
 			KBUILD_MODNAME);
-	vfree(bufhub_clipboard_ptrs);
+	idr_destroy(&bufhub_clipboard_idr);
+	if (bufhub_comp_tfm)
+		crypto_free_comp(bufhub_comp_tfm);
 	pr_info("exited successfully\n");
 }
 module_exit(bufhub_exit);
@@ -497,4 +1483,4 @@ module_exit(bufhub_exit);
 LMOD_MODULE_AUTHOR();
 LMOD_MODULE_LICENSE();
 MODULE_DESCRIPTION("A misc device that allows the creation of clipboards");
-MODULE_VERSION("1.0.5");
+MODULE_VERSION("1.8.0");
@@ -2,10 +2,49 @@
 #define _BUFHUB_IOCTL_H
 
 #include <linux/ioctl.h>
+#include <linux/types.h>
 
 #define BUFHUB_IOC_MAGIC 'b'
 #define BUFHUB_IOCCREATE  _IOR(BUFHUB_IOC_MAGIC, 0, unsigned int)
 #define BUFHUB_IOCDESTROY _IOW(BUFHUB_IOC_MAGIC, 1, unsigned int)
-#define BUFHUB_IOC_MAXNR 1
+#define BUFHUB_IOCGLIMIT  _IOWR(BUFHUB_IOC_MAGIC, 2, struct bufhub_limit)
+#define BUFHUB_IOCSLIMIT  _IOW(BUFHUB_IOC_MAGIC, 3, struct bufhub_limit)
+#define BUFHUB_IOCCREATEV  _IOWR(BUFHUB_IOC_MAGIC, 4, struct bufhub_batch)
+#define BUFHUB_IOCDESTROYV _IOW(BUFHUB_IOC_MAGIC, 5, struct bufhub_batch)
+#define BUFHUB_IOC_MAXNR 5
+
+/*
+ * how many bytes the clipboard with the given minor may grow to. limits
+ * above the bcap module parameter need CAP_SYS_RESOURCE.
+ */
+struct bufhub_limit {
+	unsigned int minor;
+	unsigned int limit;
+};
+
+/*
+ * many clipboards at once. the ioctls return how many were created or
+ * destroyed, the minors of created ones are stored in minors. minors holds
+ * a pointer to an array of count __u32s, so the layout is the same for
+ * 32 and 64 bit userspace. pad must be 0.
+ */
+struct bufhub_batch {
+	__u32 count;
+	__u32 pad;
+	__u64 minors;
+};
+
+/*
+ * ioctls on clipboards. the length is what read() returns in total, the
+ * generation counts the snapshots published before the one read.
+ */
+#define BUFHUB_CLIPBOARD_IOC_MAGIC 'B'
+#define BUFHUB_CLIPBOARD_IOCGLEN \
+	_IOR(BUFHUB_CLIPBOARD_IOC_MAGIC, 0, unsigned int)
+#define BUFHUB_CLIPBOARD_IOCSLEN \
+	_IOW(BUFHUB_CLIPBOARD_IOC_MAGIC, 1, unsigned int)
+#define BUFHUB_CLIPBOARD_IOCGGEN \
+	_IOR(BUFHUB_CLIPBOARD_IOC_MAGIC, 2, unsigned int)
+#define BUFHUB_CLIPBOARD_IOC_MAXNR 2
 
 #endif /* _BUFHUB_IOCTL_H */
@@ -3,15 +3,21 @@
 #include <errno.h>
 #include <unistd.h>
 #include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
 #include <time.h>
 #include <fcntl.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <poll.h>
 
 #include "bufhub_ioctl.h"
 
 #define MODULE_NAME "bufhub"
 #define BUFHUB_MISCDEV "/dev/" MODULE_NAME
 #define BUFHUB_CLIPBOARD BUFHUB_MISCDEV "_clipboard"
+#define BUFHUB_CLIPBOARD_SYSFS \
+	"/sys/class/" MODULE_NAME "_clipboard/" MODULE_NAME "_clipboard"
 
 static int _silent;
 static inline void bufhub_test_perror(char *msg)
@@ -159,20 +165,77 @@ static int clipboard_exists(int cid)
 	return 1;
 }
 
-static unsigned int get_max_clipboards(void)
+static unsigned int read_number(const char *path)
 {
-	char buf[8];
-	int pfd;
+	char buf[16];
+	ssize_t len;
+	int fd;
 
-	pfd = open("/sys/module/" MODULE_NAME "/parameters/max_clipboards",
-			O_RDONLY);
-	if (pfd < 0)
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return 0;
+	len = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (len < 0)
 		return 0;
-	buf[read(pfd, buf, sizeof(buf) - 1)] = 0;
-	close(pfd);
+	buf[len] = 0;
 	return (unsigned int)strtoul(buf, NULL, 10);
 }
 
+static unsigned int get_max_clipboards(void)
+{
+	return read_number("/sys/module/" MODULE_NAME
+			"/parameters/max_clipboards");
+}
+
+static unsigned int get_compress_after(void)
+{
+	return read_number("/sys/module/" MODULE_NAME
+			"/parameters/compress_after");
+}
+
+static bool get_dedup(void)
+{
+	char c = 0;
+	int fd;
+
+	fd = open("/sys/module/" MODULE_NAME "/parameters/dedup", O_RDONLY);
+	if (fd < 0)
+		return false;
+	if (read(fd, &c, 1) != 1)
+		c = 0;
+	close(fd);
+	return c == 'Y';
+}
+
+/* physical frame of the page mapped at addr, 0 if unknown */
+static uint64_t page_frame(const void *addr)
+{
+	long size = sysconf(_SC_PAGESIZE);
+	uint64_t entry;
+	int fd;
+
+	fd = open("/proc/self/pagemap", O_RDONLY);
+	if (fd < 0)
+		return 0;
+	if (pread(fd, &entry, sizeof(entry),
+			(uintptr_t)addr / size * sizeof(entry)) != sizeof(entry))
+		entry = 0;
+	close(fd);
+	/* present bit, then the frame number in the low 55 bits */
+	if (!(entry & (1ULL << 63)))
+		return 0;
+	return entry & ((1ULL << 55) - 1);
+}
+
+static unsigned int clipboard_attr(unsigned int cid, const char *attr)
+{
+	char path[sizeof(BUFHUB_CLIPBOARD_SYSFS) + 32];
+
+	sprintf(path, "%s%u/%s", BUFHUB_CLIPBOARD_SYSFS, cid, attr);
+	return read_number(path);
+}
+
 /* actual tests */
 
 static int test_readback(void)
@@ -350,6 +413,408 @@ out_none:
 	return ret;
 }
 
+static int test_mmap_readback(void)
+{
+	int mfd, cfd;
+	unsigned int cid, len;
+	char data[] = "hello, world!\n";
+	char readback[sizeof(data)];
+	size_t count = strlen(data);
+	size_t size = sysconf(_SC_PAGESIZE);
+	char *map;
+	int ret = 1;
+
+	/* shared mappings need read access, even for writers */
+	if (full_open_clibpoard(&mfd, &cfd, &cid, O_RDWR))
+		goto out_none;
+	map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, cfd, 0);
+	if (map == MAP_FAILED) {
+		bufhub_test_perror("Failed to map clipboard for writing");
+		goto out_close_clipboard;
+	}
+	memcpy(map, data, count);
+	munmap(map, size);
+	len = count;
+	if (ioctl(cfd, BUFHUB_CLIPBOARD_IOCSLEN, &len) < 0) {
+		bufhub_test_perror("Failed to set clipboard length");
+		goto out_close_clipboard;
+	}
+	if (close_clipboard(cfd))
+		goto out_close_miscdev;
+	if (open_clipboard(cid, &cfd, O_RDONLY))
+		goto out_close_miscdev;
+	if (read_clipboard(cfd, readback, count))
+		goto out_close_clipboard;
+	if (memcmp(data, readback, count))
+		goto out_close_clipboard;
+	/* readers only get to map it read only */
+	if (mmap(NULL, size, PROT_WRITE, MAP_SHARED, cfd, 0) != MAP_FAILED)
+		goto out_close_clipboard;
+	map = mmap(NULL, size, PROT_READ, MAP_SHARED, cfd, 0);
+	if (map == MAP_FAILED) {
+		bufhub_test_perror("Failed to map clipboard for reading");
+		goto out_close_clipboard;
+	}
+	if (ioctl(cfd, BUFHUB_CLIPBOARD_IOCGLEN, &len) < 0 || len != count ||
+			memcmp(data, map, count)) {
+		munmap(map, size);
+		goto out_close_clipboard;
+	}
+	munmap(map, size);
+	ret = 0;
+out_close_clipboard:
+	close_clipboard(cfd);
+out_close_miscdev:
+	close_miscdev(mfd);
+out_none:
+	return ret;
+}
+
+static int test_readers_keep_their_snapshot(void)
+{
+	int mfd, cfd, rfd = -1;
+	unsigned int cid;
+	char old[] = "hello, world!\n";
+	char new[] = "goodbye, world!\n";
+	char readback[sizeof(new)];
+	int ret = 1;
+
+	if (full_open_clibpoard(&mfd, &cfd, &cid, O_WRONLY))
+		goto out_none;
+	if (write_clipboard(cfd, old, strlen(old)))
+		goto out_close_clipboard;
+	if (close_clipboard(cfd))
+		goto out_close_miscdev;
+	if (open_clipboard(cid, &rfd, O_RDONLY))
+		goto out_close_miscdev;
+	/* writers publish their contents on close */
+	if (open_clipboard(cid, &cfd, O_WRONLY))
+		goto out_close_reader;
+	if (write_clipboard(cfd, new, strlen(new)))
+		goto out_close_clipboard;
+	if (close_clipboard(cfd))
+		goto out_close_reader;
+	if (read_clipboard(rfd, readback, strlen(old)))
+		goto out_close_reader;
+	if (memcmp(old, readback, strlen(old)))
+		goto out_close_reader;
+	if (open_clipboard(cid, &cfd, O_RDONLY))
+		goto out_close_reader;
+	if (read_clipboard(cfd, readback, strlen(new)))
+		goto out_close_clipboard;
+	if (memcmp(new, readback, strlen(new)))
+		goto out_close_clipboard;
+	ret = 0;
+out_close_clipboard:
+	close_clipboard(cfd);
+out_close_reader:
+	if (rfd >= 0)
+		close_clipboard(rfd);
+out_close_miscdev:
+	close_miscdev(mfd);
+out_none:
+	return ret;
+}
+
+static int test_clipboard_grows_up_to_limit(void)
+{
+	int mfd, cfd;
+	unsigned int cid;
+	struct bufhub_limit limit;
+	size_t size = 3 * sysconf(_SC_PAGESIZE);
+	char *data, *readback;
+	int ret = 1;
+
+	data = malloc(size);
+	readback = malloc(size);
+	if (!data || !readback)
+		goto out_free;
+	memset(data, 'x', size);
+	if (open_miscdev(&mfd))
+		goto out_free;
+	if (create_clipboard(mfd, &cid))
+		goto out_close_miscdev;
+	limit.minor = cid;
+	limit.limit = size;
+	if (ioctl(mfd, BUFHUB_IOCSLIMIT, &limit) < 0) {
+		bufhub_test_perror("Failed to set clipboard limit");
+		goto out_close_miscdev;
+	}
+	limit.limit = 0;
+	if (ioctl(mfd, BUFHUB_IOCGLIMIT, &limit) < 0 || limit.limit != size)
+		goto out_close_miscdev;
+	if (open_clipboard(cid, &cfd, O_WRONLY))
+		goto out_close_miscdev;
+	if (write_clipboard(cfd, data, size))
+		goto out_close_clipboard;
+	/* nothing beyond the limit */
+	if (write(cfd, data, 1) >= 0 || errno != ENOSPC)
+		goto out_close_clipboard;
+	if (close_clipboard(cfd))
+		goto out_close_miscdev;
+	if (open_clipboard(cid, &cfd, O_RDONLY))
+		goto out_close_miscdev;
+	if (read_clipboard(cfd, readback, size))
+		goto out_close_clipboard;
+	if (memcmp(data, readback, size))
+		goto out_close_clipboard;
+	ret = 0;
+out_close_clipboard:
+	close_clipboard(cfd);
+out_close_miscdev:
+	close_miscdev(mfd);
+out_free:
+	free(data);
+	free(readback);
+	return ret;
+}
+
+static int test_batch_create_destroy_clipboards(void)
+{
+	int mfd;
+	unsigned int minors[4];
+	unsigned int count = sizeof(minors) / sizeof(minors[0]);
+	struct bufhub_batch batch = {
+		.count = count,
+		.minors = (uintptr_t)minors,
+	};
+	unsigned int i;
+	int ret = 1;
+
+	if (get_max_clipboards() < count)
+		return 0;
+	if (open_miscdev(&mfd))
+		goto out_none;
+	if (ioctl(mfd, BUFHUB_IOCCREATEV, &batch) != count) {
+		bufhub_test_perror("Failed to create clipboards");
+		goto out_close_miscdev;
+	}
+	for (i = 0; i < count; i++)
+		if (!clipboard_exists(minors[i]))
+			goto out_close_miscdev;
+	if (ioctl(mfd, BUFHUB_IOCDESTROYV, &batch) != count) {
+		bufhub_test_perror("Failed to destroy clipboards");
+		goto out_close_miscdev;
+	}
+	for (i = 0; i < count; i++)
+		if (clipboard_exists(minors[i]))
+			goto out_close_miscdev;
+	ret = 0;
+out_close_miscdev:
+	close_miscdev(mfd);
+out_none:
+	return ret;
+}
+
+static int test_poll_reports_new_snapshot(void)
+{
+	int mfd, cfd, rfd;
+	unsigned int cid, gen;
+	char data[] = "hello, world!\n";
+	char readback[sizeof(data)];
+	struct pollfd pfd;
+	int ret = 1;
+
+	if (full_open_clibpoard(&mfd, &rfd, &cid, O_RDONLY))
+		goto out_none;
+	pfd.fd = rfd;
+	pfd.events = POLLIN;
+	if (poll(&pfd, 1, 0) != 0)
+		goto out_close_reader;
+	if (open_clipboard(cid, &cfd, O_WRONLY))
+		goto out_close_reader;
+	if (write_clipboard(cfd, data, strlen(data))) {
+		close_clipboard(cfd);
+		goto out_close_reader;
+	}
+	if (close_clipboard(cfd))
+		goto out_close_reader;
+	if (poll(&pfd, 1, 0) != 1 || !(pfd.revents & POLLIN))
+		goto out_close_reader;
+	/* querying the position keeps the old snapshot */
+	if (lseek(rfd, 0, SEEK_CUR) != 0)
+		goto out_close_reader;
+	if (ioctl(rfd, BUFHUB_CLIPBOARD_IOCGGEN, &gen) < 0 || gen != 0)
+		goto out_close_reader;
+	/* seeking back to the start picks up the new contents */
+	if (lseek(rfd, 0, SEEK_SET) != 0)
+		goto out_close_reader;
+	if (read_clipboard(rfd, readback, strlen(data)))
+		goto out_close_reader;
+	if (memcmp(data, readback, strlen(data)))
+		goto out_close_reader;
+	if (ioctl(rfd, BUFHUB_CLIPBOARD_IOCGGEN, &gen) < 0 || gen != 1)
+		goto out_close_reader;
+	if (poll(&pfd, 1, 0) != 0)
+		goto out_close_reader;
+	ret = 0;
+out_close_reader:
+	close_clipboard(rfd);
+	close_miscdev(mfd);
+out_none:
+	return ret;
+}
+
+static int test_untouched_draft_is_not_published(void)
+{
+	int mfd, cfd, rfd;
+	unsigned int cid, gen;
+	struct pollfd pfd;
+	int ret = 1;
+
+	if (full_open_clibpoard(&mfd, &rfd, &cid, O_RDONLY))
+		goto out_none;
+	if (open_clipboard(cid, &cfd, O_RDWR))
+		goto out_close_reader;
+	if (close_clipboard(cfd))
+		goto out_close_reader;
+	pfd.fd = rfd;
+	pfd.events = POLLIN;
+	if (poll(&pfd, 1, 0) != 0)
+		goto out_close_reader;
+	if (lseek(rfd, 0, SEEK_SET) != 0)
+		goto out_close_reader;
+	if (ioctl(rfd, BUFHUB_CLIPBOARD_IOCGGEN, &gen) < 0 || gen != 0)
+		goto out_close_reader;
+	ret = 0;
+out_close_reader:
+	close_clipboard(rfd);
+	close_miscdev(mfd);
+out_none:
+	return ret;
+}
+
+static int test_cold_clipboard_is_compressed(void)
+{
+	int mfd, cfd;
+	unsigned int cid, zlen;
+	unsigned int after = get_compress_after();
+	size_t size = sysconf(_SC_PAGESIZE);
+	char line[] = "hello, world!\n";
+	char *data, *readback;
+	size_t i;
+	int ret = 1;
+
+	/* only when loaded with compress_after */
+	if (!after)
+		return 0;
+	data = malloc(size);
+	readback = malloc(size);
+	if (!data || !readback)
+		goto out_free;
+	for (i = 0; i < size; i++)
+		data[i] = line[i % strlen(line)];
+	if (full_open_clibpoard(&mfd, &cfd, &cid, O_WRONLY))
+		goto out_free;
+	if (write_clipboard(cfd, data, size))
+		goto out_close_clipboard;
+	if (close_clipboard(cfd))
+		goto out_close_miscdev;
+	/* the worker runs every compress_after seconds */
+	sleep(3 * after);
+	zlen = clipboard_attr(cid, "compressed_size");
+	if (clipboard_attr(cid, "raw_size") != size || !zlen || zlen >= size) {
+		fprintf(stderr, "Clipboard was not compressed\n");
+		goto out_close_miscdev;
+	}
+	if (open_clipboard(cid, &cfd, O_RDONLY))
+		goto out_close_miscdev;
+	if (read_clipboard(cfd, readback, size))
+		goto out_close_clipboard;
+	if (memcmp(data, readback, size))
+		goto out_close_clipboard;
+	/* opening it inflated it again */
+	if (clipboard_attr(cid, "compressed_size"))
+		goto out_close_clipboard;
+	ret = 0;
+out_close_clipboard:
+	close_clipboard(cfd);
+out_close_miscdev:
+	close_miscdev(mfd);
+out_free:
+	free(data);
+	free(readback);
+	return ret;
+}
+
+static int test_dedup_shares_clean_buffer(void)
+{
+	int mfd, cfd, rfd0 = -1, rfd1 = -1;
+	unsigned int cid0, cid1, len;
+	char data[] = "hello, world!\nsecret";
+	size_t count = strlen("hello, world!\n");
+	size_t size = sysconf(_SC_PAGESIZE);
+	char *map0 = MAP_FAILED, *map1 = MAP_FAILED;
+	size_t i;
+	int ret = 1;
+
+	/* only when loaded with dedup */
+	if (!get_dedup())
+		return 0;
+	if (open_miscdev(&mfd))
+		goto out_none;
+	if (create_clipboard(mfd, &cid0) || create_clipboard(mfd, &cid1))
+		goto out_close_miscdev;
+	/* the first one leaves a secret behind the end of its contents */
+	if (open_clipboard(cid0, &cfd, O_RDWR))
+		goto out_close_miscdev;
+	if (write_clipboard(cfd, data, strlen(data))) {
+		close_clipboard(cfd);
+		goto out_close_miscdev;
+	}
+	len = count;
+	if (ioctl(cfd, BUFHUB_CLIPBOARD_IOCSLEN, &len) < 0) {
+		bufhub_test_perror("Failed to set clipboard length");
+		close_clipboard(cfd);
+		goto out_close_miscdev;
+	}
+	if (close_clipboard(cfd))
+		goto out_close_miscdev;
+	if (open_clipboard(cid1, &cfd, O_WRONLY))
+		goto out_close_miscdev;
+	if (write_clipboard(cfd, data, count)) {
+		close_clipboard(cfd);
+		goto out_close_miscdev;
+	}
+	if (close_clipboard(cfd))
+		goto out_close_miscdev;
+	if (open_clipboard(cid0, &rfd0, O_RDONLY) ||
+			open_clipboard(cid1, &rfd1, O_RDONLY))
+		goto out_close_readers;
+	map0 = mmap(NULL, size, PROT_READ, MAP_SHARED, rfd0, 0);
+	map1 = mmap(NULL, size, PROT_READ, MAP_SHARED, rfd1, 0);
+	if (map0 == MAP_FAILED || map1 == MAP_FAILED) {
+		bufhub_test_perror("Failed to map clipboard for reading");
+		goto out_unmap;
+	}
+	if (memcmp(data, map1, count))
+		goto out_unmap;
+	for (i = count; i < size; i++)
+		if (map1[i]) {
+			fprintf(stderr, "Stale data past the clipboard end\n");
+			goto out_unmap;
+		}
+	if (!page_frame(map0) || page_frame(map0) != page_frame(map1)) {
+		fprintf(stderr, "Identical clipboards do not share memory\n");
+		goto out_unmap;
+	}
+	ret = 0;
+out_unmap:
+	if (map0 != MAP_FAILED)
+		munmap(map0, size);
+	if (map1 != MAP_FAILED)
+		munmap(map1, size);
+out_close_readers:
+	if (rfd0 >= 0)
+		close_clipboard(rfd0);
+	if (rfd1 >= 0)
+		close_clipboard(rfd1);
+out_close_miscdev:
+	close_miscdev(mfd);
+out_none:
+	return ret;
+}
+
 struct single_test {
 	int (*test_fn)(void);
 	char *name;
@@ -369,6 +834,14 @@ static struct single_test all_tests[] = {
 	test_entry(test_closing_miscdev_does_not_destroy_open_clipbaord),
 	test_entry(test_clipboard_destruction_fails_with_wrong_master),
 	test_entry(test_creation_fails_with_too_many_clipboards),
+	test_entry(test_mmap_readback),
+	test_entry(test_readers_keep_their_snapshot),
+	test_entry(test_clipboard_grows_up_to_limit),
+	test_entry(test_batch_create_destroy_clipboards),
+	test_entry(test_poll_reports_new_snapshot),
+	test_entry(test_untouched_draft_is_not_published),
+	test_entry(test_cold_clipboard_is_compressed),
+	test_entry(test_dedup_shares_clean_buffer),
 };
 
 int main(int argc, char *argv[])
@@ -7,4 +7,12 @@ cd $(dirname $0)
 insmod $MODULE.ko
 ./test.out || err=1
 rmmod $MODULE
+# again with identical contents shared between clipboards
+insmod $MODULE.ko dedup=1
+./test.out || err=1
+rmmod $MODULE
+# again with cold clipboards compressed after a second
+insmod $MODULE.ko compress_after=1
+./test.out || err=1
+rmmod $MODULE
 exit $err
@@ -0,0 +1,508 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+
+#include "cpipe_ioctl.h"
+
+#define MODULE_NAME "cpipe"
+#define CPIPE_DEV "/dev/" MODULE_NAME
+#define CPIPE_DEV_NAME_LEN (sizeof(CPIPE_DEV) + 24)
+
+#define MAX_SIZES 16
+#define NSEC_PER_SEC 1000000000ULL
+
+/*
+ * every message starts with the time it was written at, which consumers use
+ * to measure latency. a zero timestamp tells a consumer to stop.
+ */
+typedef uint64_t bench_stamp_t;
+
+struct bench_conf {
+	int npairs;
+	/* producers and consumers per pair */
+	int nthreads;
+	/* messages sent by each producer */
+	long nmsgs;
+	/* buffer size to set, or 0 to keep the current one */
+	int bsize;
+	int packet;
+	int csv;
+	size_t sizes[MAX_SIZES];
+	int nsizes;
+	int f_flags[2];
+	int nmodes;
+};
+
+struct bench_thread {
+	pthread_t tid;
+	int fd;
+	size_t size;
+	long nmsgs;
+	pthread_barrier_t *start;
+	/* consumer results */
+	uint64_t *lat;
+	long nlat;
+	int err;
+};
+
+static const char *bench_mode_name(int f_flags)
+{
+	return (f_flags & O_NONBLOCK) ? "nonblock" : "block";
+}
+
+static inline uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+static inline void dev_name(char *buf, int pair, int end)
+{
+	sprintf(buf, "%s%d.%d", CPIPE_DEV, pair, end);
+}
+
+/* end 0 is written by producers, and end 1 is read by consumers */
+static int open_end(int pair, int end, int f_flags)
+{
+	char buf[CPIPE_DEV_NAME_LEN];
+	int fd;
+
+	dev_name(buf, pair, end);
+	fd = open(buf, (end ? O_RDONLY : O_WRONLY) | f_flags);
+	if (fd < 0)
+		perror("Failed to open pipe end");
+	return fd;
+}
+
+/* wait until a nonblocking fd is ready instead of spinning on EAGAIN */
+static int wait_ready(int fd, short events)
+{
+	struct pollfd pfd = {
+		.fd = fd,
+		.events = events,
+	};
+
+	while (poll(&pfd, 1, -1) < 0)
+		if (errno != EINTR)
+			return 1;
+	return 0;
+}
+
+/*
+ * a message is moved in pieces in stream mode, but with a single producer
+ * and consumer per pair, they can't interleave with other messages.
+ */
+static int write_msg(int fd, const char *buf, size_t size)
+{
+	size_t off = 0;
+	ssize_t n;
+
+	while (off < size) {
+		n = write(fd, buf + off, size - off);
+		if (n < 0) {
+			if (errno == EAGAIN) {
+				if (wait_ready(fd, POLLOUT))
+					return 1;
+				continue;
+			}
+			if (errno == EINTR)
+				continue;
+			perror("Failed to write to pipe");
+			return 1;
+		}
+		off += n;
+	}
+	return 0;
+}
+
+static int read_msg(int fd, char *buf, size_t size)
+{
+	size_t off = 0;
+	ssize_t n;
+
+	while (off < size) {
+		n = read(fd, buf + off, size - off);
+		if (n < 0) {
+			if (errno == EAGAIN) {
+				if (wait_ready(fd, POLLIN))
+					return 1;
+				continue;
+			}
+			if (errno == EINTR)
+				continue;
+			perror("Failed to read from pipe");
+			return 1;
+		}
+		off += n;
+	}
+	return 0;
+}
+
+static int write_stamp(int fd, char *buf, size_t size, bench_stamp_t stamp)
+{
+	memcpy(buf, &stamp, sizeof(stamp));
+	return write_msg(fd, buf, size);
+}
+
+static void *producer(void *arg)
+{
+	struct bench_thread *t = arg;
+	char *buf;
+	long i;
+
+	buf = calloc(1, t->size);
+	if (!buf) {
+		t->err = 1;
+		pthread_barrier_wait(t->start);
+		return NULL;
+	}
+	pthread_barrier_wait(t->start);
+	for (i = 0; i < t->nmsgs; i++) {
+		if (write_stamp(t->fd, buf, t->size, now_ns())) {
+			t->err = 1;
+			break;
+		}
+	}
+	free(buf);
+	return NULL;
+}
+
+static void *consumer(void *arg)
+{
+	struct bench_thread *t = arg;
+	bench_stamp_t stamp;
+	char *buf;
+
+	buf = malloc(t->size);
+	if (!buf) {
+		t->err = 1;
+		pthread_barrier_wait(t->start);
+		return NULL;
+	}
+	pthread_barrier_wait(t->start);
+	for (;;) {
+		if (read_msg(t->fd, buf, t->size)) {
+			t->err = 1;
+			break;
+		}
+		memcpy(&stamp, buf, sizeof(stamp));
+		if (!stamp)
+			break;
+		t->lat[t->nlat++] = now_ns() - stamp;
+	}
+	free(buf);
+	return NULL;
+}
+
+static int setup_pair(struct bench_conf *conf, int pair)
+{
+	int fd, ret = 1;
+	int packet = conf->packet;
+	int bsize = conf->bsize;
+
+	fd = open_end(pair, 1, 0);
+	if (fd < 0)
+		return 1;
+	if (bsize && ioctl(fd, CPIPE_IOCSBSIZE, &bsize) < 0) {
+		perror("Failed to set buffer size");
+		goto out;
+	}
+	if (ioctl(fd, CPIPE_IOCSPACKET, &packet) < 0) {
+		perror("Failed to set packet mode");
+		goto out;
+	}
+	ret = 0;
+out:
+	close(fd);
+	return ret;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return (x > y) - (x < y);
+}
+
+static uint64_t percentile(uint64_t *sorted, long n, int p)
+{
+	if (!n)
+		return 0;
+	return sorted[(n - 1) * p / 100];
+}
+
+static void print_header(struct bench_conf *conf)
+{
+	if (conf->csv)
+		printf("size,mode,packet,pairs,threads,msgs,ns,mb_s,msgs_s,p50_ns,p99_ns\n");
+	else
+		printf("%8s %-8s %6s %5s %7s %10s %12s %10s %10s\n",
+				"size", "mode", "packet", "pairs", "threads",
+				"MB/s", "msgs/s", "p50(us)", "p99(us)");
+}
+
+static void print_result(struct bench_conf *conf, size_t size, int f_flags,
+		long msgs, uint64_t ns, uint64_t p50, uint64_t p99)
+{
+	double secs = (double)ns / NSEC_PER_SEC;
+	double mbs = msgs * (double)size / secs / 1e6;
+	double msgss = msgs / secs;
+
+	if (conf->csv)
+		printf("%zu,%s,%d,%d,%d,%ld,%llu,%.2f,%.0f,%llu,%llu\n",
+				size, bench_mode_name(f_flags), conf->packet,
+				conf->npairs, conf->nthreads, msgs,
+				(unsigned long long)ns, mbs, msgss,
+				(unsigned long long)p50,
+				(unsigned long long)p99);
+	else
+		printf("%8zu %-8s %6d %5d %7d %10.2f %12.0f %10.2f %10.2f\n",
+				size, bench_mode_name(f_flags), conf->packet,
+				conf->npairs, conf->nthreads, mbs, msgss,
+				p50 / 1e3, p99 / 1e3);
+	fflush(stdout);
+}
+
+static int run(struct bench_conf *conf, size_t size, int f_flags)
+{
+	int n = conf->npairs * conf->nthreads;
+	struct bench_thread *prod, *cons;
+	pthread_barrier_t start;
+	long total = 0, per_pair = conf->nthreads * conf->nmsgs;
+	uint64_t *lat = NULL, t0, t1;
+	char *buf = NULL;
+	int i, j, ret = 1;
+
+	for (i = 0; i < conf->npairs; i++)
+		if (setup_pair(conf, i))
+			return 1;
+	prod = calloc(n, sizeof(*prod));
+	cons = calloc(n, sizeof(*cons));
+	buf = calloc(1, size);
+	if (!prod || !cons || !buf)
+		goto out_free;
+	for (i = 0; i < n; i++)
+		prod[i].fd = cons[i].fd = -1;
+	for (i = 0; i < n; i++) {
+		cons[i].lat = malloc(per_pair * sizeof(*cons[i].lat));
+		if (!cons[i].lat)
+			goto out_close;
+	}
+	for (i = 0; i < n; i++) {
+		prod[i].fd = open_end(i / conf->nthreads, 0, f_flags);
+		cons[i].fd = open_end(i / conf->nthreads, 1, f_flags);
+		if (prod[i].fd < 0 || cons[i].fd < 0)
+			goto out_close;
+	}
+	pthread_barrier_init(&start, NULL, 2 * n + 1);
+	for (i = 0; i < n; i++) {
+		prod[i].size = cons[i].size = size;
+		prod[i].nmsgs = conf->nmsgs;
+		prod[i].start = cons[i].start = &start;
+		/* started threads are stuck on the barrier, so just bail out */
+		if (pthread_create(&cons[i].tid, NULL, consumer, &cons[i]) ||
+				pthread_create(&prod[i].tid, NULL, producer,
+					&prod[i])) {
+			fprintf(stderr, "Failed to start threads\n");
+			exit(1);
+		}
+	}
+	pthread_barrier_wait(&start);
+	t0 = now_ns();
+	for (i = 0; i < n; i++)
+		pthread_join(prod[i].tid, NULL);
+	/* one stop message per consumer of each pair */
+	for (i = 0; i < n; i++)
+		write_stamp(prod[i - i % conf->nthreads].fd, buf, size, 0);
+	for (i = 0; i < n; i++)
+		pthread_join(cons[i].tid, NULL);
+	t1 = now_ns();
+	ret = 0;
+	for (i = 0; i < n; i++) {
+		ret |= prod[i].err | cons[i].err;
+		total += cons[i].nlat;
+	}
+	if (ret)
+		goto out_barrier;
+	lat = malloc((total ? total : 1) * sizeof(*lat));
+	if (!lat) {
+		ret = 1;
+		goto out_barrier;
+	}
+	for (i = 0, j = 0; i < n; i++) {
+		memcpy(lat + j, cons[i].lat, cons[i].nlat * sizeof(*lat));
+		j += cons[i].nlat;
+	}
+	qsort(lat, total, sizeof(*lat), cmp_u64);
+	print_result(conf, size, f_flags, total, t1 - t0,
+			percentile(lat, total, 50), percentile(lat, total, 99));
+	free(lat);
+out_barrier:
+	pthread_barrier_destroy(&start);
+out_close:
+	for (i = 0; i < n; i++) {
+		if (prod[i].fd >= 0)
+			close(prod[i].fd);
+		if (cons[i].fd >= 0)
+			close(cons[i].fd);
+		free(cons[i].lat);
+	}
+out_free:
+	free(buf);
+	free(cons);
+	free(prod);
+	return ret;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"usage: %s [-p pairs] [-t threads] [-n msgs] [-s size,...]\n"
+		"          [-m block|nonblock,...] [-b bsize] [-P] [-c]\n"
+		"  -p  number of pipe pairs to use, starting at %s0 (1)\n"
+		"  -t  producers and consumers per pair (1), needs -P if > 1\n"
+		"  -n  messages sent by each producer (100000)\n"
+		"  -s  message sizes in bytes (64,4096)\n"
+		"  -m  blocking modes (block,nonblock)\n"
+		"  -b  buffer size to set on each pair\n"
+		"  -P  use packet mode\n"
+		"  -c  print csv\n",
+		prog, CPIPE_DEV);
+}
+
+static int parse_sizes(struct bench_conf *conf, char *arg)
+{
+	char *tok, *end;
+
+	conf->nsizes = 0;
+	for (tok = strtok(arg, ","); tok; tok = strtok(NULL, ",")) {
+		if (conf->nsizes == MAX_SIZES)
+			return 1;
+		conf->sizes[conf->nsizes] = strtoul(tok, &end, 0);
+		if (*end)
+			return 1;
+		conf->nsizes++;
+	}
+	return !conf->nsizes;
+}
+
+static int parse_modes(struct bench_conf *conf, char *arg)
+{
+	char *tok;
+
+	conf->nmodes = 0;
+	for (tok = strtok(arg, ","); tok; tok = strtok(NULL, ",")) {
+		if (conf->nmodes == 2)
+			return 1;
+		if (!strcmp(tok, "block"))
+			conf->f_flags[conf->nmodes++] = 0;
+		else if (!strcmp(tok, "nonblock"))
+			conf->f_flags[conf->nmodes++] = O_NONBLOCK;
+		else
+			return 1;
+	}
+	return !conf->nmodes;
+}
+
+static int check_conf(struct bench_conf *conf)
+{
+	int i;
+
+	if (conf->npairs < 1 || conf->nthreads < 1 || conf->nmsgs < 1) {
+		fprintf(stderr, "pairs, threads and msgs must be positive\n");
+		return 1;
+	}
+	if (conf->nthreads > 1 && !conf->packet) {
+		fprintf(stderr, "messages can interleave in stream mode\n");
+		return 1;
+	}
+	for (i = 0; i < conf->nsizes; i++) {
+		if (conf->sizes[i] < sizeof(bench_stamp_t)) {
+			fprintf(stderr, "size %zu is smaller than %zu\n",
+					conf->sizes[i], sizeof(bench_stamp_t));
+			return 1;
+		}
+		if (conf->packet && conf->sizes[i] > CPIPE_PACKET_MAX) {
+			fprintf(stderr, "size %zu is larger than %d\n",
+					conf->sizes[i], CPIPE_PACKET_MAX);
+			return 1;
+		}
+	}
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	struct bench_conf conf = {
+		.npairs = 1,
+		.nthreads = 1,
+		.nmsgs = 100000,
+		.sizes = { 64, 4096 },
+		.nsizes = 2,
+		.f_flags = { 0, O_NONBLOCK },
+		.nmodes = 2,
+	};
+	int opt, i, j, ret = 0;
+
+	while ((opt = getopt(argc, argv, "p:t:n:s:m:b:Pch")) != -1) {
+		switch (opt) {
+		case 'p':
+			conf.npairs = atoi(optarg);
+			break;
+		case 't':
+			conf.nthreads = atoi(optarg);
+			break;
+		case 'n':
+			conf.nmsgs = atol(optarg);
+			break;
+		case 's':
+			if (parse_sizes(&conf, optarg)) {
+				usage(argv[0]);
+				return 1;
+			}
+			break;
+		case 'm':
+			if (parse_modes(&conf, optarg)) {
+				usage(argv[0]);
+				return 1;
+			}
+			break;
+		case 'b':
+			conf.bsize = atoi(optarg);
+			break;
+		case 'P':
+			conf.packet = 1;
+			break;
+		case 'c':
+			conf.csv = 1;
+			break;
+		default:
+			usage(argv[0]);
+			return opt != 'h';
+		}
+	}
+	if (check_conf(&conf))
+		return 1;
+	print_header(&conf);
+	for (i = 0; i < conf.nsizes; i++) {
+		for (j = 0; j < conf.nmodes; j++) {
+			if (run(&conf, conf.sizes[i], conf.f_flags[j])) {
+				dprintf(2, "%s: run with size %zu mode %s failed\n",
+						argv[0], conf.sizes[i],
+						bench_mode_name(conf.f_flags[j]));
+				ret = 1;
+			}
+		}
+	}
+	return ret;
+}
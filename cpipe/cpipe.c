@@ -9,15 +9,78 @@
 #include <linux/sched.h>
 #include <linux/poll.h>
 #include <linux/vmalloc.h>
+#include <linux/mm.h>
+#include <linux/pipe_fs_i.h>
+#include <linux/splice.h>
+#include <linux/log2.h>
+#include <linux/capability.h>
+#include <linux/miscdevice.h>
+#include <linux/slab.h>
+#include <linux/list.h>
+#include <linux/uio.h>
+#include <linux/percpu.h>
+#include <linux/gfp.h>
+#include <linux/topology.h>
+#include <linux/file.h>
+#include <linux/workqueue.h>
+#include <linux/wait.h>
+#include <linux/version.h>
 
 #include <lmod/meta.h>
 
 #include "cpipe_ioctl.h"
 
+/* wait_queue_t was renamed in 4.13 */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 13, 0)
+typedef wait_queue_t wait_queue_entry_t;
+#endif
+
+#define CPIPE_STATS_FILL_SHIFT 3
+#define CPIPE_STATS_FILL_BUCKETS (1 << CPIPE_STATS_FILL_SHIFT)
+
+/*
+ * counters of the reads and writes done through one end. stream reads and
+ * writes count as one message each.
+ */
+struct cpipe_stats {
+	u64 rbytes, wbytes;
+	u64 rmsgs, wmsgs;
+	/* times a reader or writer went to sleep in cpipe_wait */
+	u64 rblocks, wblocks;
+	u64 reagains, weagains;
+	/* fill level of rfifo seen by reads, in eighths of its size */
+	u64 fill[CPIPE_STATS_FILL_BUCKETS];
+};
+
 struct cpipe_dev {
+	/* in and out live in ring, see cpipe_fifo_load */
 	struct kfifo rfifo;
+	/* header mapped to userspace in front of rfifo's data */
+	struct cpipe_ring *ring;
 	struct mutex rmutex; /* protects rbuf */
+	/* rfifo holds messages, see cpipe_fifo_to_iter */
+	bool packet;
+	/* CPIPE_BCAST_*, see cpipe_bcast_trim */
+	int bcast;
+	/* cursors of the files reading rfifo, protected by rmutex */
+	struct list_head cursors;
+	/*
+	 * readers of rfifo are woken once rlowat bytes are queued, and
+	 * writers once wlowat bytes are free. see cpipe_dev_rlowat.
+	 */
+	unsigned int rlowat, wlowat;
 	wait_queue_head_t rq, wq;
+	/*
+	 * openers reading from and writing to rfifo, used in spsc mode.
+	 * only incremented with rmutex locked.
+	 */
+	atomic_t nreaders, nwriters;
+	atomic_t nmaps; /* vmas mapping rfifo */
+	int node; /* numa node rfifo was allocated on */
+	/* forwarding rfifo to another buffer, see struct cpipe_fwd */
+	struct cpipe_fwd *fwd;
+	unsigned int nfwd; /* links from or to rfifo, protected by rmutex */
+	struct cpipe_stats __percpu *stats;
 	struct device *dev;
 	struct cpipe_dev *twin;
 };
@@ -28,19 +91,87 @@ struct cpipe_dev {
 #define cpipe_dev_twin(cpdev) ((cpdev)->twin)
 #define cpipe_dev_wfifo(cpdev) (&cpipe_dev_twin(cpdev)->rfifo)
 #define cpipe_dev_wmutex(cpdev) (&cpipe_dev_twin(cpdev)->rmutex)
+#define cpipe_dev_stats_add(cpdev, field, n) \
+	this_cpu_add((cpdev)->stats->field, (n))
+
+/* an open file of an end */
+struct cpipe_file {
+	struct cpipe_dev *dev;
+	/* in broadcast mode, every reader has its own out index */
+	unsigned int pos;
+	struct list_head cursor_link;
+	/* reads keep the message headers, see CPIPE_IOCSPKTHDR */
+	bool pkthdr;
+};
+
+#define cpipe_filp_dev(filp) \
+	(((struct cpipe_file *)(filp)->private_data)->dev)
+
+#define CPIPE_RING_HDR_SIZE PAGE_SIZE
+
+/* locking policy
+ * if both a pair's master_lock and the master's pairs_list_lock are
+ * required for an operation, the pair's master_lock is to be locked first.
+ */
+
+struct cpipe_master {
+	struct list_head pairs_list;
+	spinlock_t pairs_list_lock; /* protects pairs_list */
+};
 
 struct cpipe_pair {
 	struct cpipe_dev devices[2];
+	int index;
+	struct kref kref;
+	struct list_head master_link;
+	struct cpipe_master *master;
+	spinlock_t master_lock; /* protects master */
+	/*
+	 * buffers are only allocated when the pair is first opened. they are
+	 * kept until the pair is destroyed, since data queued by a writer
+	 * must still be there for a reader that opens the other end later.
+	 */
+	bool allocated;
+	struct mutex alloc_mutex; /* protects allocated */
 };
 
+#define cpipe_dev_pair(cpdev) \
+	container_of((cpdev) - (MINOR(cpipe_dev_devt(cpdev)) & 1), \
+			struct cpipe_pair, devices[0])
+
 static int cpipe_npipes = 1;
 module_param_named(npipes, cpipe_npipes, int, 0444);
-MODULE_PARM_DESC(npipes, "number of pipes to create");
+MODULE_PARM_DESC(npipes, "number of pipes to create at load time");
+
+static int cpipe_max_pipes = 64;
+module_param_named(max_pipes, cpipe_max_pipes, int, 0444);
+MODULE_PARM_DESC(max_pipes,
+	"maximum number of pipes that can exist at the same time");
 
 static int cpipe_bsize = PAGE_SIZE;
 module_param_named(bsize, cpipe_bsize, int, 0444);
 MODULE_PARM_DESC(bsize, "size (in bytes) of each buffer");
 
+static int cpipe_max_bsize = 1024 * 1024;
+module_param_named(max_bsize, cpipe_max_bsize, int, 0644);
+MODULE_PARM_DESC(max_bsize,
+	"maximum size (in bytes) a buffer can be resized to without CAP_SYS_RESOURCE");
+
+static bool cpipe_spsc;
+module_param_named(spsc, cpipe_spsc, bool, 0444);
+MODULE_PARM_DESC(spsc,
+	"lockless mode allowing one reader and one writer per buffer");
+
+static int cpipe_node = NUMA_NO_NODE;
+module_param_named(node, cpipe_node, int, 0644);
+MODULE_PARM_DESC(node,
+	"numa node to allocate buffers on, or -1 for the node of the first opener");
+
+static bool cpipe_contig;
+module_param_named(contig, cpipe_contig, bool, 0644);
+MODULE_PARM_DESC(contig,
+	"allocate buffers from physically contiguous pages, which the kernel maps with huge pages");
+
 static int __init cpipe_check_module_params(void)
 {
 	int err = 0;
@@ -49,6 +180,11 @@ static int __init cpipe_check_module_params(void)
 		pr_err("cpipe_npipes < 0. value = %d\n", cpipe_npipes);
 		err = -EINVAL;
 	}
+	if (cpipe_max_pipes < cpipe_npipes) {
+		pr_err("cpipe_max_pipes < cpipe_npipes. value = %d\n",
+				cpipe_max_pipes);
+		err = -EINVAL;
+	}
 	if (cpipe_bsize < 0) {
 		pr_err("cpipe_bsize < 0. value = 0x%x\n", cpipe_bsize);
 		err = -EINVAL;
@@ -62,7 +198,8 @@ static int __init cpipe_check_module_params(void)
 	return err;
 }
 
-static struct cpipe_pair *cpipe_pairs;
+static struct cpipe_pair **cpipe_pair_ptrs;
+static DEFINE_SPINLOCK(cpipe_pair_ptrs_lock);
 static int cpipe_major;
 static struct class *cpipe_class;
 static const char cpipe_twin_link_name[] = "twin";
@@ -77,219 +214,1804 @@ static int cpipe_mutex_lock(struct mutex *mutex, int f_flags)
 	return 0;
 }
 
-/*
- * get available read size
- * called with the mutex locked
- * kfifo_len is a macro and can't be addressed
- */
-static int cpipe_fifo_len(struct kfifo *fifo)
+/*
+ * in spsc mode there's only ever one reader and one writer per fifo,
+ * which kfifo handles without locking.
+ */
+static int cpipe_fifo_lock(struct mutex *mutex, int f_flags)
+{
+	if (cpipe_spsc)
+		return 0;
+	return cpipe_mutex_lock(mutex, f_flags);
+}
+
+static void cpipe_fifo_unlock(struct mutex *mutex)
+{
+	if (!cpipe_spsc)
+		mutex_unlock(mutex);
+}
+
+#define CPIPE_POLLRD (POLLIN | POLLRDNORM)
+#define CPIPE_POLLWR (POLLOUT | POLLWRNORM)
+
+/*
+ * wake up a waitqueue only if someone is sleeping on it.
+ * the barrier orders the fifo update before the waitqueue check and pairs
+ * with the one implied by set_current_state in prepare_to_wait, or the one
+ * in cpipe_poll.
+ * the key lets epoll skip waiters that aren't interested in the event.
+ * blocked readers and writers wait exclusively, so only one of them is
+ * woken up, along with every poller.
+ */
+static void cpipe_wake_up(wait_queue_head_t *waitq, unsigned int key)
+{
+	smp_mb();
+	if (waitqueue_active(waitq))
+		wake_up_interruptible_poll(waitq, key);
+}
+
+/* in broadcast mode, every reader has to see the new data */
+static void cpipe_wake_up_readers(struct cpipe_dev *dev)
+{
+	smp_mb();
+	if (!waitqueue_active(&dev->rq))
+		return;
+	if (READ_ONCE(dev->bcast))
+		__wake_up(&dev->rq, TASK_INTERRUPTIBLE, 0,
+				(void *)CPIPE_POLLRD);
+	else
+		wake_up_interruptible_poll(&dev->rq, CPIPE_POLLRD);
+}
+
+/*
+ * vmalloc'ed buffers are mapped page by page, in the kernel too. a
+ * physically contiguous buffer lives in the linear map, which is mapped
+ * with huge pages, so it takes far fewer tlb entries. it's split into
+ * single pages so they can be mapped to userspace like vmalloc'ed ones.
+ */
+static void *cpipe_buf_alloc(size_t size, int node)
+{
+	unsigned int order = get_order(size);
+	struct page *page;
+
+	if (READ_ONCE(cpipe_contig) && order < MAX_ORDER) {
+		page = alloc_pages_node(node, GFP_KERNEL | __GFP_ZERO |
+				__GFP_NOWARN | __GFP_NORETRY, order);
+		if (page) {
+			split_page(page, order);
+			return page_address(page);
+		}
+	}
+	return vzalloc_node(size, node);
+}
+
+static void cpipe_buf_free(void *buf, size_t size)
+{
+	if (is_vmalloc_addr(buf))
+		vfree(buf);
+	else if (buf)
+		free_pages_exact(buf, size);
+}
+
+static struct page *cpipe_buf_to_page(void *buf)
+{
+	if (is_vmalloc_addr(buf))
+		return vmalloc_to_page(buf);
+	return virt_to_page(buf);
+}
+
+/* allocate page aligned fifo data that may be mapped to userspace */
+static int cpipe_fifo_alloc(struct kfifo *fifo, unsigned int size, int node)
+{
+	void *data;
+	int err;
+
+	data = cpipe_buf_alloc(PAGE_ALIGN(size), node);
+	if (!data)
+		return -ENOMEM;
+	err = kfifo_init(fifo, data, size);
+	if (err)
+		cpipe_buf_free(data, PAGE_ALIGN(size));
+	return err;
+}
+
+static void cpipe_fifo_free(struct kfifo *fifo)
+{
+	cpipe_buf_free(fifo->kfifo.data, PAGE_ALIGN(kfifo_size(fifo)));
+}
+
+/* the node buffers go on when they're first allocated */
+static int cpipe_default_node(void)
+{
+	int node = READ_ONCE(cpipe_node);
+
+	if (node < 0 || node >= nr_node_ids || !node_online(node))
+		return numa_node_id();
+	return node;
+}
+
+/*
+ * copy the data pending in src to dst without changing its indices,
+ * so in and out stay valid when dst replaces src.
+ */
+static void cpipe_fifo_copy(struct kfifo *dst, struct kfifo *src)
+{
+	unsigned int off, soff, doff, n;
+
+	for (off = src->kfifo.out; off != src->kfifo.in; off += n) {
+		soff = off & src->kfifo.mask;
+		doff = off & dst->kfifo.mask;
+		n = min3(src->kfifo.in - off, kfifo_size(src) - soff,
+				kfifo_size(dst) - doff);
+		memcpy(dst->kfifo.data + doff, src->kfifo.data + soff, n);
+	}
+	dst->kfifo.in = src->kfifo.in;
+	dst->kfifo.out = src->kfifo.out;
+}
+
+/*
+ * the fifo's indices are kept in the ring header so userspace can access the
+ * ring directly. work on a private copy of the fifo with the indices loaded
+ * from the header, and publish whichever index was advanced afterwards.
+ * the header is writable by userspace, so the indices can't be trusted.
+ */
+static int cpipe_fifo_load(struct cpipe_dev *dev, struct kfifo *fifo)
+{
+	struct cpipe_ring *ring = dev->ring;
+
+	*fifo = dev->rfifo;
+	fifo->kfifo.in = smp_load_acquire(&ring->in);
+	fifo->kfifo.out = smp_load_acquire(&ring->out);
+	if (fifo->kfifo.in - fifo->kfifo.out > kfifo_size(fifo)) {
+		/* userspace can keep it that way, don't flood the log */
+		pr_err_ratelimited("%s: corrupted ring. in = %u, out = %u\n",
+				cpipe_dev_name(dev), fifo->kfifo.in,
+				fifo->kfifo.out);
+		return -EIO;
+	}
+	return 0;
+}
+
+static void cpipe_fifo_store_in(struct cpipe_dev *dev, struct kfifo *fifo)
+{
+	smp_store_release(&dev->ring->in, fifo->kfifo.in);
+}
+
+static void cpipe_fifo_store_out(struct cpipe_dev *dev, struct kfifo *fifo)
+{
+	smp_store_release(&dev->ring->out, fifo->kfifo.out);
+}
+
+/* lockless peeks at the ring header, used as wait and poll conditions */
+static unsigned int cpipe_ring_len(struct cpipe_dev *dev)
+{
+	return READ_ONCE(dev->ring->in) - READ_ONCE(dev->ring->out);
+}
+
+static bool cpipe_ring_is_empty(struct cpipe_dev *dev)
+{
+	return !cpipe_ring_len(dev);
+}
+
+static unsigned int cpipe_ring_avail(struct cpipe_dev *dev)
+{
+	unsigned int len = cpipe_ring_len(dev);
+	unsigned int size = kfifo_size(&dev->rfifo);
+
+	return len < size ? size - len : 0;
+}
+
+/*
+ * watermarks are clamped to the buffer size when used, so they can always
+ * be reached even if the buffer shrinks.
+ * sleepers and wakers use the same watermark, so no wakeup is missed.
+ */
+static unsigned int cpipe_dev_rlowat(struct cpipe_dev *dev)
+{
+	unsigned int max = kfifo_size(&dev->rfifo);
+
+	/*
+	 * messages don't tile the ring, writers may block with up to a
+	 * header and the largest message free. readers must wake up before.
+	 */
+	if (READ_ONCE(dev->packet))
+		max = max > CPIPE_PACKET_HDR_SIZE + CPIPE_PACKET_MAX ?
+			max - CPIPE_PACKET_HDR_SIZE - CPIPE_PACKET_MAX + 1 : 1;
+	return clamp_t(unsigned int, READ_ONCE(dev->rlowat), 1, max);
+}
+
+static unsigned int cpipe_dev_wlowat(struct cpipe_dev *dev)
+{
+	return clamp_t(unsigned int, READ_ONCE(dev->wlowat), 1,
+			kfifo_size(&dev->rfifo));
+}
+
+static bool cpipe_ring_is_readable(struct cpipe_dev *dev)
+{
+	return cpipe_ring_len(dev) >= cpipe_dev_rlowat(dev);
+}
+
+static bool cpipe_ring_is_writable(struct cpipe_dev *dev)
+{
+	return cpipe_ring_avail(dev) >= cpipe_dev_wlowat(dev);
+}
+
+/*
+ * in packet mode, each message in the fifo is preceded by its length,
+ * CPIPE_PACKET_HDR_SIZE bytes in little endian.
+ */
+static unsigned int cpipe_fifo_peek_msglen(struct kfifo *fifo)
+{
+	u8 *data = fifo->kfifo.data;
+	unsigned int mask = fifo->kfifo.mask;
+	unsigned int out = fifo->kfifo.out;
+
+	return data[out & mask] | (data[(out + 1) & mask] << 8);
+}
+
+static void cpipe_fifo_poke_msglen(struct kfifo *fifo, unsigned int len)
+{
+	u8 *data = fifo->kfifo.data;
+	unsigned int mask = fifo->kfifo.mask;
+	unsigned int in = fifo->kfifo.in;
+
+	data[in & mask] = len & 0xff;
+	data[(in + 1) & mask] = (len >> 8) & 0xff;
+}
+
+/* largest message that can ever fit in the fifo */
+static unsigned int cpipe_fifo_max_msglen(struct kfifo *fifo)
+{
+	return min_t(unsigned int, kfifo_size(fifo) - CPIPE_PACKET_HDR_SIZE,
+			CPIPE_PACKET_MAX);
+}
+
+/*
+ * get available read size
+ * called with the mutex locked
+ * in packet mode, that's the length of the next message
+ */
+static int cpipe_fifo_len(struct kfifo *fifo, bool packet)
+{
+	if (!packet)
+		return kfifo_len(fifo);
+	if (kfifo_is_empty(fifo))
+		return 0;
+	return cpipe_fifo_peek_msglen(fifo);
+}
+
+/*
+ * get available write write
+ * called with the mutex locked
+ * in packet mode, that's the largest message that can be written
+ */
+static int cpipe_fifo_avail(struct kfifo *fifo, bool packet)
+{
+	unsigned int avail = kfifo_avail(fifo);
+
+	if (!packet)
+		return avail;
+	if (avail < CPIPE_PACKET_HDR_SIZE)
+		return 0;
+	return min_t(unsigned int, avail - CPIPE_PACKET_HDR_SIZE,
+			CPIPE_PACKET_MAX);
+}
+
+/* lockless peek at a reader's cursor, used in broadcast mode */
+static bool cpipe_cursor_is_readable(struct cpipe_file *cfile)
+{
+	struct cpipe_dev *dev = cfile->dev;
+
+	return READ_ONCE(dev->ring->in) - READ_ONCE(cfile->pos) >=
+		cpipe_dev_rlowat(dev);
+}
+
+static bool cpipe_file_is_readable(struct cpipe_file *cfile)
+{
+	if (READ_ONCE(cfile->dev->bcast))
+		return cpipe_cursor_is_readable(cfile);
+	return cpipe_ring_is_readable(cfile->dev);
+}
+
+/*
+ * in broadcast mode, data is only dropped once every reader has read it,
+ * so out follows the slowest cursor. cursors never fall behind out.
+ * without readers, there's no one to keep the data for.
+ */
+static void cpipe_bcast_trim(struct cpipe_dev *dev, struct kfifo *fifo)
+{
+	struct cpipe_file *cfile;
+	unsigned int len = 0;
+
+	list_for_each_entry(cfile, &dev->cursors, cursor_link)
+		len = max(len, fifo->kfifo.in - cfile->pos);
+	fifo->kfifo.out = fifo->kfifo.in - len;
+}
+
+/*
+ * make room for need bytes by dropping the oldest data, and move the
+ * readers that lost data to the new out. in packet mode, only whole
+ * messages are dropped, so cursors stay on message boundaries.
+ */
+static int cpipe_bcast_overwrite(struct cpipe_dev *dev, struct kfifo *fifo,
+		unsigned int need)
+{
+	struct cpipe_file *cfile;
+	unsigned int msglen;
+
+	if (kfifo_avail(fifo) >= need)
+		return 0;
+	if (!dev->packet) {
+		fifo->kfifo.out = fifo->kfifo.in + need - kfifo_size(fifo);
+	} else {
+		while (kfifo_avail(fifo) < need) {
+			msglen = cpipe_fifo_peek_msglen(fifo);
+			if (msglen + CPIPE_PACKET_HDR_SIZE > kfifo_len(fifo))
+				return -EIO;
+			fifo->kfifo.out += CPIPE_PACKET_HDR_SIZE + msglen;
+		}
+	}
+	list_for_each_entry(cfile, &dev->cursors, cursor_link)
+		if (fifo->kfifo.in - cfile->pos > kfifo_len(fifo))
+			WRITE_ONCE(cfile->pos, fifo->kfifo.out);
+	return 0;
+}
+
+/*
+ * it's assumed the mutex is needed for the condition.
+ * release it either way to simplify code.
+ * in spsc mode the mutex isn't held, and the condition is checked after
+ * prepare_to_wait so a concurrent cpipe_wake_up can't be missed.
+ * the wait is exclusive, so a waiter that's interrupted after it was woken
+ * up passes the wakeup on.
+ */
+#define cpipe_wait(waitq, key, mutex, sleep_cond) \
+({ \
+	int __ret = 0; \
+	wait_queue_head_t *__waitq = (waitq); \
+	DEFINE_WAIT(wait); \
+	prepare_to_wait_exclusive(__waitq, &wait, TASK_INTERRUPTIBLE); \
+	if (sleep_cond) { \
+		cpipe_fifo_unlock(mutex); \
+		schedule(); \
+	} else \
+		cpipe_fifo_unlock(mutex); \
+	finish_wait(__waitq, &wait); \
+	if (signal_pending(current)) { \
+		__ret = -ERESTARTSYS; \
+		if (!(sleep_cond)) \
+			cpipe_wake_up(__waitq, key); \
+	} \
+	__ret; \
+})
+
+/* copy len bytes starting at index off of fifo, handling wrap around */
+static size_t cpipe_fifo_copy_to_iter(struct kfifo *fifo, unsigned int off,
+		size_t len, struct iov_iter *iter)
+{
+	size_t l, n;
+
+	off &= fifo->kfifo.mask;
+	l = min_t(size_t, len, kfifo_size(fifo) - off);
+	n = copy_to_iter(fifo->kfifo.data + off, l, iter);
+	if (n == l && len > l)
+		n += copy_to_iter(fifo->kfifo.data, len - l, iter);
+	return n;
+}
+
+static size_t cpipe_fifo_copy_from_iter(struct kfifo *fifo, unsigned int off,
+		size_t len, struct iov_iter *iter)
+{
+	size_t l, n;
+
+	off &= fifo->kfifo.mask;
+	l = min_t(size_t, len, kfifo_size(fifo) - off);
+	n = copy_from_iter(fifo->kfifo.data + off, l, iter);
+	if (n == l && len > l)
+		n += copy_from_iter(fifo->kfifo.data, len - l, iter);
+	return n;
+}
+
+/*
+ * in packet mode, every segment of iter receives one message, which is
+ * truncated if the segment is too short for it. a message shorter than its
+ * segment ends the batch, so that the length of every message can be
+ * deduced from the total.
+ */
+static int cpipe_fifo_to_iter(struct kfifo *fifo, bool packet,
+		struct iov_iter *iter, size_t *copied, unsigned int *nmsgs)
+{
+	unsigned int msglen;
+	size_t seg, len, n;
+
+	*copied = 0;
+	*nmsgs = 0;
+	if (!packet) {
+		len = min_t(size_t, kfifo_len(fifo), iov_iter_count(iter));
+		n = cpipe_fifo_copy_to_iter(fifo, fifo->kfifo.out, len, iter);
+		if (len && !n)
+			return -EFAULT;
+		fifo->kfifo.out += n;
+		*copied = n;
+		*nmsgs = !!n;
+		return 0;
+	}
+	while (!kfifo_is_empty(fifo) && iov_iter_count(iter)) {
+		seg = iov_iter_single_seg_count(iter);
+		if (!seg) {
+			/* skip empty segments */
+			iov_iter_advance(iter, 0);
+			continue;
+		}
+		msglen = cpipe_fifo_peek_msglen(fifo);
+		if (msglen + CPIPE_PACKET_HDR_SIZE > kfifo_len(fifo))
+			return -EIO;
+		len = min_t(size_t, msglen, seg);
+		n = cpipe_fifo_copy_to_iter(fifo,
+				fifo->kfifo.out + CPIPE_PACKET_HDR_SIZE, len,
+				iter);
+		if (n < len)
+			return *copied ? 0 : -EFAULT;
+		fifo->kfifo.out += CPIPE_PACKET_HDR_SIZE + msglen;
+		*copied += n;
+		(*nmsgs)++;
+		if (len < seg)
+			break;
+	}
+	return 0;
+}
+
+/*
+ * copy as many whole messages as fit in iter, each preceded by its header,
+ * so that messages of any length can be received in one go.
+ */
+static int cpipe_fifo_msgs_to_iter(struct kfifo *fifo, struct iov_iter *iter,
+		size_t *copied, unsigned int *nmsgs)
+{
+	unsigned int len;
+	size_t n;
+
+	*copied = 0;
+	*nmsgs = 0;
+	while (!kfifo_is_empty(fifo)) {
+		len = CPIPE_PACKET_HDR_SIZE + cpipe_fifo_peek_msglen(fifo);
+		if (len > kfifo_len(fifo))
+			return -EIO;
+		if (len > iov_iter_count(iter))
+			return *copied ? 0 : -EMSGSIZE;
+		n = cpipe_fifo_copy_to_iter(fifo, fifo->kfifo.out, len, iter);
+		if (n < len)
+			return *copied ? 0 : -EFAULT;
+		fifo->kfifo.out += len;
+		*copied += len;
+		(*nmsgs)++;
+	}
+	return 0;
+}
+
+/*
+ * in packet mode, every segment of iter is written as one message, as long
+ * as there's room for them.
+ */
+static int cpipe_fifo_from_iter(struct kfifo *fifo, bool packet,
+		struct iov_iter *iter, size_t *copied, unsigned int *nmsgs)
+{
+	size_t seg, len, n;
+
+	*copied = 0;
+	*nmsgs = 0;
+	if (!packet) {
+		len = min_t(size_t, kfifo_avail(fifo), iov_iter_count(iter));
+		n = cpipe_fifo_copy_from_iter(fifo, fifo->kfifo.in, len, iter);
+		if (len && !n)
+			return -EFAULT;
+		fifo->kfifo.in += n;
+		*copied = n;
+		*nmsgs = !!n;
+		return 0;
+	}
+	while (iov_iter_count(iter)) {
+		seg = iov_iter_single_seg_count(iter);
+		if (!seg) {
+			iov_iter_advance(iter, 0);
+			continue;
+		}
+		/* the header could not hold its length */
+		if (seg > cpipe_fifo_max_msglen(fifo))
+			return *copied ? 0 : -EMSGSIZE;
+		if (seg + CPIPE_PACKET_HDR_SIZE > kfifo_avail(fifo))
+			break;
+		n = cpipe_fifo_copy_from_iter(fifo,
+				fifo->kfifo.in + CPIPE_PACKET_HDR_SIZE, seg,
+				iter);
+		if (n < seg)
+			return *copied ? 0 : -EFAULT;
+		cpipe_fifo_poke_msglen(fifo, seg);
+		fifo->kfifo.in += CPIPE_PACKET_HDR_SIZE + seg;
+		*copied += seg;
+		(*nmsgs)++;
+	}
+	return 0;
+}
+
+static void cpipe_stats_fill(struct cpipe_dev *dev, struct kfifo *fifo)
+{
+	unsigned int size = kfifo_size(fifo);
+	unsigned int i;
+
+	/* size is a power of 2 */
+	i = ((u64)kfifo_len(fifo) << CPIPE_STATS_FILL_SHIFT) >> ilog2(size);
+	cpipe_dev_stats_add(dev, fill[min(i, CPIPE_STATS_FILL_BUCKETS - 1U)], 1);
+}
+
+/* room a write needs before it can make progress */
+static int cpipe_fifo_write_need(struct kfifo *fifo, bool packet,
+		struct iov_iter *iter, unsigned int *need)
+{
+	struct iov_iter tmp = *iter;
+	size_t seg;
+
+	if (!packet) {
+		*need = 1;
+		return 0;
+	}
+	/* the first message is the first non-empty segment */
+	for (;;) {
+		seg = iov_iter_single_seg_count(&tmp);
+		if (seg)
+			break;
+		iov_iter_advance(&tmp, 0);
+	}
+	if (seg > cpipe_fifo_max_msglen(fifo))
+		return -EMSGSIZE;
+	*need = seg + CPIPE_PACKET_HDR_SIZE;
+	return 0;
+}
+
+static ssize_t __cpipe_read(struct cpipe_file *cfile, int f_flags,
+		struct iov_iter *iter)
+{
+	struct cpipe_dev *dev = cfile->dev;
+	struct kfifo fifo;
+	struct mutex *mutex = &dev->rmutex;
+	ssize_t ret;
+	size_t copied = 0;
+	unsigned int nmsgs;
+	bool bcast;
+
+	if (!iov_iter_count(iter))
+		return 0;
+again:
+	ret = cpipe_fifo_lock(mutex, f_flags);
+	if (ret)
+		return ret;
+	ret = cpipe_fifo_load(dev, &fifo);
+	if (ret)
+		goto out;
+	cpipe_stats_fill(dev, &fifo);
+	/* spsc mode is never broadcast, so bcast can't change unlocked */
+	bcast = dev->bcast;
+	if (bcast)
+		fifo.kfifo.out = cfile->pos;
+	/* blocking readers wait for the low watermark */
+	if ((f_flags & O_NONBLOCK) == O_NONBLOCK ||
+			kfifo_len(&fifo) >= cpipe_dev_rlowat(dev)) {
+		if (dev->packet && READ_ONCE(cfile->pkthdr))
+			ret = cpipe_fifo_msgs_to_iter(&fifo, iter, &copied,
+					&nmsgs);
+		else
+			ret = cpipe_fifo_to_iter(&fifo, dev->packet, iter,
+					&copied, &nmsgs);
+		if (ret)
+			goto out;
+	}
+	if (!copied) {
+		if ((f_flags & O_NONBLOCK) == O_NONBLOCK) {
+			cpipe_dev_stats_add(dev, reagains, 1);
+			ret = -EAGAIN;
+			goto out;
+		} else {
+			cpipe_dev_stats_add(dev, rblocks, 1);
+			ret = cpipe_wait(&dev->rq, CPIPE_POLLRD, mutex,
+					!cpipe_file_is_readable(cfile));
+			/* cpipe_wait unlocks the mutex */
+			if (ret)
+				return ret;
+			goto again;
+		}
+	}
+	if (bcast) {
+		WRITE_ONCE(cfile->pos, fifo.kfifo.out);
+		cpipe_bcast_trim(dev, &fifo);
+	}
+	cpipe_fifo_store_out(dev, &fifo);
+	cpipe_dev_stats_add(dev, rbytes, copied);
+	cpipe_dev_stats_add(dev, rmsgs, nmsgs);
+	/* enough room was freed, wake up writers waiting on this pipe */
+	if (cpipe_ring_is_writable(dev))
+		cpipe_wake_up(&dev->twin->wq, CPIPE_POLLWR);
+	/* there's more to read, pass it on to the next reader */
+	if (!bcast && cpipe_ring_is_readable(dev))
+		cpipe_wake_up(&dev->rq, CPIPE_POLLRD);
+	ret = copied;
+out:
+	cpipe_fifo_unlock(mutex);
+	return ret;
+}
+
+static ssize_t __cpipe_write(struct cpipe_dev *dev, int f_flags,
+		struct iov_iter *iter)
+{
+	struct cpipe_dev *twin = cpipe_dev_twin(dev);
+	struct kfifo fifo;
+	struct mutex *mutex = cpipe_dev_wmutex(dev);
+	unsigned int need, nmsgs;
+	ssize_t ret;
+	size_t copied;
+
+	if (!iov_iter_count(iter))
+		return 0;
+again:
+	ret = cpipe_fifo_lock(mutex, f_flags);
+	if (ret)
+		return ret;
+	ret = cpipe_fifo_load(twin, &fifo);
+	if (ret)
+		goto out;
+	ret = cpipe_fifo_write_need(&fifo, twin->packet, iter, &need);
+	if (ret)
+		goto out;
+	if (twin->bcast) {
+		cpipe_bcast_trim(twin, &fifo);
+		if (twin->bcast == CPIPE_BCAST_OVERWRITE) {
+			/* never wait for readers, drop old data instead */
+			ret = cpipe_bcast_overwrite(twin, &fifo, twin->packet ?
+					need : min_t(size_t, kfifo_size(&fifo),
+						iov_iter_count(iter)));
+			if (ret)
+				goto out;
+		}
+		cpipe_fifo_store_out(twin, &fifo);
+	}
+	ret = cpipe_fifo_from_iter(&fifo, twin->packet, iter, &copied,
+			&nmsgs);
+	if (ret)
+		goto out;
+	if (!copied) {
+		if ((f_flags & O_NONBLOCK) == O_NONBLOCK) {
+			cpipe_dev_stats_add(dev, weagains, 1);
+			ret = -EAGAIN;
+			goto out;
+		} else {
+			cpipe_dev_stats_add(dev, wblocks, 1);
+			need = max(need, cpipe_dev_wlowat(twin));
+			ret = cpipe_wait(&dev->wq, CPIPE_POLLWR, mutex,
+					cpipe_ring_avail(twin) < need);
+			/* cpipe_wait unlocks the mutex */
+			if (ret)
+				return ret;
+			goto again;
+		}
+	}
+	cpipe_fifo_store_in(twin, &fifo);
+	cpipe_dev_stats_add(dev, wbytes, copied);
+	cpipe_dev_stats_add(dev, wmsgs, nmsgs);
+	/* enough data was written, wake up readers waiting on this pipe */
+	if (cpipe_ring_is_readable(twin))
+		cpipe_wake_up_readers(twin);
+	/* there's more room, pass it on to the next writer */
+	if (cpipe_ring_is_writable(twin))
+		cpipe_wake_up(&dev->wq, CPIPE_POLLWR);
+	ret = copied;
+out:
+	cpipe_fifo_unlock(mutex);
+	return ret;
+}
+
+/*
+ * RWF_NOWAIT asks for a nonblocking attempt per request, so aio can fall
+ * back to polling the file on -EAGAIN instead of blocking in io_submit.
+ * IOCB_NOWAIT only exists since 4.13.
+ */
+static int cpipe_iocb_f_flags(struct kiocb *iocb)
+{
+	int f_flags = iocb->ki_filp->f_flags;
+
+#ifdef IOCB_NOWAIT
+	if (iocb->ki_flags & IOCB_NOWAIT)
+		f_flags |= O_NONBLOCK;
+#endif
+	return f_flags;
+}
+
+static ssize_t cpipe_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+	return __cpipe_read(iocb->ki_filp->private_data,
+			cpipe_iocb_f_flags(iocb), to);
+}
+
+static ssize_t cpipe_write_iter(struct kiocb *iocb, struct iov_iter *from)
+{
+	return __cpipe_write(cpipe_filp_dev(iocb->ki_filp),
+			cpipe_iocb_f_flags(iocb), from);
+}
+
+static int cpipe_splice_f_flags(struct file *filp, unsigned int flags)
+{
+	if (flags & SPLICE_F_NONBLOCK)
+		return filp->f_flags | O_NONBLOCK;
+	return filp->f_flags;
+}
+
+/*
+ * pages handed to the pipe by cpipe_splice_read are private copies, so the
+ * consumer may steal them.
+ */
+static const struct pipe_buf_operations cpipe_pipe_buf_ops = {
+	.can_merge = 0,
+	.confirm = generic_pipe_buf_confirm,
+	.release = generic_pipe_buf_release,
+	.steal = generic_pipe_buf_steal,
+	.get = generic_pipe_buf_get,
+};
+
+static void cpipe_spd_release(struct splice_pipe_desc *spd, unsigned int i)
+{
+	put_page(spd->pages[i]);
+}
+
+/*
+ * the ring is shared with mapped peers, so its pages can't be lent to the
+ * pipe. instead, move the data into fresh pages that the pipe owns, without
+ * bouncing it through userspace.
+ * messages don't map onto pipe buffers, so splice is for byte streams only.
+ */
+static ssize_t cpipe_splice_read(struct file *filp, loff_t *ppos,
+		struct pipe_inode_info *pipe, size_t len, unsigned int flags)
+{
+	struct cpipe_dev *dev = cpipe_filp_dev(filp);
+	struct page *pages[PIPE_DEF_BUFFERS];
+	struct partial_page partial[PIPE_DEF_BUFFERS];
+	struct splice_pipe_desc spd = {
+		.pages = pages,
+		.partial = partial,
+		.nr_pages_max = PIPE_DEF_BUFFERS,
+		.flags = flags,
+		.ops = &cpipe_pipe_buf_ops,
+		.spd_release = cpipe_spd_release,
+	};
+	int f_flags = cpipe_splice_f_flags(filp, flags);
+	struct iov_iter iter;
+	struct kvec kvec;
+	struct page *page;
+	ssize_t ret = 0;
+
+	if (READ_ONCE(dev->packet))
+		return -EINVAL;
+	/*
+	 * the caller either holds the pipe lock or owns the pipe, and
+	 * splice_to_pipe doesn't wait for room, so everything that's taken
+	 * out of the ring below lands in the pipe. check what would make it
+	 * fail before consuming anything.
+	 */
+	if (!pipe->readers) {
+		send_sig(SIGPIPE, current, 0);
+		return -EPIPE;
+	}
+	spd.nr_pages_max = min_t(unsigned int, spd.nr_pages_max,
+			pipe->buffers - pipe->nrbufs);
+	if (!spd.nr_pages_max)
+		return -EAGAIN;
+	while (len && spd.nr_pages < spd.nr_pages_max) {
+		page = alloc_page(GFP_KERNEL);
+		if (!page) {
+			ret = -ENOMEM;
+			break;
+		}
+		kvec.iov_base = page_address(page);
+		kvec.iov_len = min_t(size_t, len, PAGE_SIZE);
+		iov_iter_kvec(&iter, ITER_KVEC | READ, &kvec, 1, kvec.iov_len);
+		ret = __cpipe_read(filp->private_data, f_flags, &iter);
+		if (ret <= 0) {
+			put_page(page);
+			break;
+		}
+		pages[spd.nr_pages] = page;
+		partial[spd.nr_pages].offset = 0;
+		partial[spd.nr_pages].len = ret;
+		spd.nr_pages++;
+		len -= ret;
+		/* only block until the first page is filled */
+		f_flags |= O_NONBLOCK;
+	}
+	if (spd.nr_pages)
+		ret = splice_to_pipe(pipe, &spd);
+	return ret;
+}
+
+static int cpipe_pipe_to_ring(struct pipe_inode_info *pipe,
+		struct pipe_buffer *buf, struct splice_desc *sd)
+{
+	struct file *filp = sd->u.file;
+	struct iov_iter iter;
+	struct kvec kvec;
+	ssize_t ret;
+
+	kvec.iov_base = kmap(buf->page) + buf->offset;
+	kvec.iov_len = sd->len;
+	iov_iter_kvec(&iter, ITER_KVEC | WRITE, &kvec, 1, kvec.iov_len);
+	ret = __cpipe_write(cpipe_filp_dev(filp),
+			cpipe_splice_f_flags(filp, sd->flags), &iter);
+	kunmap(buf->page);
+	return ret;
+}
+
+/* move data from the pipe's pages straight into the ring */
+static ssize_t cpipe_splice_write(struct pipe_inode_info *pipe,
+		struct file *filp, loff_t *ppos, size_t len, unsigned int flags)
+{
+	struct cpipe_dev *dev = cpipe_filp_dev(filp);
+	struct splice_desc sd = {
+		.total_len = len,
+		.flags = flags,
+		.pos = *ppos,
+		.u.file = filp,
+	};
+	ssize_t ret;
+
+	if (READ_ONCE(cpipe_dev_twin(dev)->packet))
+		return -EINVAL;
+	pipe_lock(pipe);
+	ret = __splice_from_pipe(pipe, &sd, cpipe_pipe_to_ring);
+	pipe_unlock(pipe);
+	if (ret > 0)
+		*ppos += ret;
+	return ret;
+}
+
+/*
+ * the ring indices are read without locking, so readiness is reported
+ * even while a reader or writer holds the mutex.
+ */
+static unsigned int cpipe_poll(struct file *filp, poll_table *wait)
+{
+	struct cpipe_dev *dev = cpipe_filp_dev(filp);
+	unsigned int mask = 0;
+
+	poll_wait(filp, &dev->rq, wait);
+	poll_wait(filp, &dev->wq, wait);
+	/* pairs with the barrier in cpipe_wake_up */
+	smp_mb();
+	/* read */
+	if (cpipe_file_is_readable(filp->private_data))
+		mask |= CPIPE_POLLRD;
+	/* write */
+	if (cpipe_ring_is_writable(cpipe_dev_twin(dev)))
+		mask |= CPIPE_POLLWR;
+	return mask;
+}
+
+static int cpipe_ioctl_IOCGAVAILXX(struct mutex *mutex, struct cpipe_dev *dev,
+	int (*get_availxx)(struct kfifo *, bool), int f_flags, int __user *ret)
+{
+	struct kfifo fifo;
+	int err;
+
+	err = cpipe_fifo_lock(mutex, f_flags);
+	if (err)
+		return err;
+	err = cpipe_fifo_load(dev, &fifo);
+	if (!err)
+		err = put_user(get_availxx(&fifo, dev->packet), ret);
+	/* not checking err since there's nothing to do before returning it */
+	cpipe_fifo_unlock(mutex);
+	return err;
+}
+
+/*
+ * in spsc mode readers and writers don't lock rmutex, so the buffer can only
+ * be replaced or reformatted while no one else has it open.
+ */
+static int cpipe_spsc_check_exclusive(struct cpipe_dev *dev, fmode_t f_mode)
+{
+	int nreaders = atomic_read(&dev->nreaders);
+
+	if (f_mode & FMODE_READ)
+		nreaders--;
+	if (nreaders || atomic_read(&dev->nwriters))
+		return -EBUSY;
+	return 0;
+}
+
+/*
+ * replace the buffer read from this end with one of the given size on the
+ * given node, keeping the data in it
+ */
+static int cpipe_realloc(struct cpipe_dev *dev, fmode_t f_mode,
+		unsigned int size, int node)
+{
+	struct kfifo fifo, new_fifo;
+	int err;
+
+	err = cpipe_fifo_alloc(&new_fifo, size, node);
+	if (err)
+		return err;
+	mutex_lock(&dev->rmutex);
+	if (cpipe_spsc) {
+		err = cpipe_spsc_check_exclusive(dev, f_mode);
+		if (err)
+			goto out;
+	}
+	if (atomic_read(&dev->nmaps)) {
+		err = -EBUSY;
+		goto out;
+	}
+	err = cpipe_fifo_load(dev, &fifo);
+	if (err)
+		goto out;
+	if (kfifo_len(&fifo) > size ||
+			(dev->packet && size < CPIPE_PACKET_HDR_SIZE + 1)) {
+		err = -EBUSY;
+		goto out;
+	}
+	cpipe_fifo_copy(&new_fifo, &fifo);
+	swap(dev->rfifo, new_fifo);
+	WRITE_ONCE(dev->ring->size, kfifo_size(&dev->rfifo));
+	WRITE_ONCE(dev->node, node);
+out:
+	mutex_unlock(&dev->rmutex);
+	/* either the old buffer or the unused new one */
+	cpipe_fifo_free(&new_fifo);
+	if (!err)
+		/* there may be room for writers now */
+		cpipe_wake_up(&cpipe_dev_twin(dev)->wq, CPIPE_POLLWR);
+	return err;
+}
+
+static int cpipe_ioctl_IOCSBSIZE(struct file *filp, int __user *uptr)
+{
+	struct cpipe_dev *dev = cpipe_filp_dev(filp);
+	int size;
+	int err;
+
+	err = get_user(size, uptr);
+	if (err)
+		return err;
+	if (size < 2 || size > INT_MAX / 2)
+		return -EINVAL;
+	size = roundup_pow_of_two(size);
+	if (size > cpipe_max_bsize && !capable(CAP_SYS_RESOURCE))
+		return -EPERM;
+	err = cpipe_realloc(dev, filp->f_mode, size, READ_ONCE(dev->node));
+	if (err)
+		return err;
+	pr_info("resized %s to %d bytes\n", cpipe_dev_name(dev), size);
+	return put_user(size, uptr);
+}
+
+/*
+ * switch the buffer read from this end between a byte stream and messages.
+ * the two formats can't be mixed, so the buffer has to be empty.
+ */
+static int cpipe_ioctl_IOCSPACKET(struct file *filp, int __user *uptr)
+{
+	struct cpipe_dev *dev = cpipe_filp_dev(filp);
+	int packet;
+	int err;
+
+	err = get_user(packet, uptr);
+	if (err)
+		return err;
+	mutex_lock(&dev->rmutex);
+	if (cpipe_spsc) {
+		err = cpipe_spsc_check_exclusive(dev, filp->f_mode);
+		if (err)
+			goto out;
+	}
+	if (!cpipe_ring_is_empty(dev) || atomic_read(&dev->nmaps) ||
+			dev->nfwd ||
+			kfifo_size(&dev->rfifo) <= CPIPE_PACKET_HDR_SIZE) {
+		err = -EBUSY;
+		goto out;
+	}
+	WRITE_ONCE(dev->packet, !!packet);
+out:
+	mutex_unlock(&dev->rmutex);
+	return err;
+}
+
+/* move the buffer read from this end to another numa node */
+static int cpipe_ioctl_IOCSNODE(struct file *filp, int __user *uptr)
+{
+	struct cpipe_dev *dev = cpipe_filp_dev(filp);
+	int node;
+	int err;
+
+	err = get_user(node, uptr);
+	if (err)
+		return err;
+	if (node < 0)
+		node = numa_node_id();
+	if (node >= nr_node_ids || !node_online(node))
+		return -EINVAL;
+	err = cpipe_realloc(dev, filp->f_mode, kfifo_size(&dev->rfifo), node);
+	if (err)
+		return err;
+	pr_info("moved %s to node %d\n", cpipe_dev_name(dev), node);
+	return put_user(node, uptr);
+}
+
+/*
+ * switch the buffer read from this end between point-to-point and
+ * broadcast. readers that had it open start at the current in.
+ */
+static int cpipe_ioctl_IOCSBCAST(struct file *filp, int __user *uptr)
+{
+	struct cpipe_dev *dev = cpipe_filp_dev(filp);
+	struct cpipe_file *cfile;
+	struct kfifo fifo;
+	int bcast;
+	int err;
+
+	err = get_user(bcast, uptr);
+	if (err)
+		return err;
+	if (bcast < CPIPE_BCAST_OFF || bcast > CPIPE_BCAST_OVERWRITE)
+		return -EINVAL;
+	/* spsc readers and writers don't lock, so cursors can't be shared */
+	if (cpipe_spsc)
+		return -EINVAL;
+	mutex_lock(&dev->rmutex);
+	err = cpipe_fifo_load(dev, &fifo);
+	if (err)
+		goto out;
+	if (dev->bcast) {
+		/* drop what no reader needs anymore */
+		cpipe_bcast_trim(dev, &fifo);
+		cpipe_fifo_store_out(dev, &fifo);
+	}
+	if (!kfifo_is_empty(&fifo) || atomic_read(&dev->nmaps) || dev->nfwd) {
+		err = -EBUSY;
+		goto out;
+	}
+	list_for_each_entry(cfile, &dev->cursors, cursor_link)
+		WRITE_ONCE(cfile->pos, fifo.kfifo.in);
+	WRITE_ONCE(dev->bcast, bcast);
+out:
+	mutex_unlock(&dev->rmutex);
+	return err;
+}
+
+static int cpipe_ioctl_IOCSXXLOWAT(unsigned int *lowat,
+		wait_queue_head_t *waitq, int __user *uptr)
+{
+	int val;
+	int err;
+
+	err = get_user(val, uptr);
+	if (err)
+		return err;
+	if (val < 1)
+		return -EINVAL;
+	WRITE_ONCE(*lowat, val);
+	/* let sleepers recheck against the new watermark */
+	wake_up_interruptible_all(waitq);
+	return 0;
+}
+
+static inline int __must_check cpipe_pair_get(struct cpipe_pair *pair)
+{
+	return kref_get_unless_zero(&pair->kref);
+}
+
+static void cpipe_pair_kref_release(struct kref *kref);
+
+static inline void cpipe_pair_put(struct cpipe_pair *pair)
+{
+	kref_put(&pair->kref, cpipe_pair_kref_release);
+}
+
+/*
+ * forwarding moves data from the buffer read from one end into the buffer
+ * written through another, without going through userspace. the link
+ * listens on the same waitqueues blocked readers and writers use, so it
+ * runs whenever there's new data in the source or new room in the
+ * destination. the source's read watermark and the destination's write
+ * watermark apply to it too.
+ * a buffer is forwarded to at most one other buffer, and links can't form
+ * loops, so src's rmutex can always be locked before dst's.
+ */
+struct cpipe_fwd {
+	struct cpipe_dev *src, *dst;
+	/* the file that created the link, which removes it when closed */
+	struct cpipe_file *owner;
+	wait_queue_entry_t src_wait, dst_wait;
+	struct work_struct work;
+};
+
+static DEFINE_MUTEX(cpipe_fwd_mutex); /* protects the fwd of every dev */
+
+static const struct file_operations cpipe_fops;
+
+/* the number of bytes that can move from src to dst */
+static int cpipe_fifo_move_len(struct kfifo *dst, struct kfifo *src,
+		bool packet, unsigned int *len)
+{
+	unsigned int avail = kfifo_avail(dst);
+	unsigned int msglen, n = 0;
+	struct kfifo tmp = *src;
+
+	if (!packet) {
+		*len = min(kfifo_len(src), avail);
+		return 0;
+	}
+	/* whole messages only */
+	while (!kfifo_is_empty(&tmp)) {
+		msglen = cpipe_fifo_peek_msglen(&tmp);
+		if (msglen + CPIPE_PACKET_HDR_SIZE > kfifo_len(&tmp))
+			return -EIO;
+		if (n + CPIPE_PACKET_HDR_SIZE + msglen > avail)
+			break;
+		n += CPIPE_PACKET_HDR_SIZE + msglen;
+		tmp.kfifo.out += CPIPE_PACKET_HDR_SIZE + msglen;
+	}
+	*len = n;
+	return 0;
+}
+
+static void cpipe_fifo_move(struct kfifo *dst, struct kfifo *src,
+		unsigned int len)
+{
+	unsigned int soff, doff, n;
+
+	for (; len; len -= n) {
+		soff = src->kfifo.out & src->kfifo.mask;
+		doff = dst->kfifo.in & dst->kfifo.mask;
+		n = min3(len, kfifo_size(src) - soff, kfifo_size(dst) - doff);
+		memcpy(dst->kfifo.data + doff, src->kfifo.data + soff, n);
+		src->kfifo.out += n;
+		dst->kfifo.in += n;
+	}
+}
+
+static void cpipe_fwd_work(struct work_struct *work)
+{
+	struct cpipe_fwd *fwd = container_of(work, struct cpipe_fwd, work);
+	struct cpipe_dev *src = fwd->src, *dst = fwd->dst;
+	struct kfifo sfifo, dfifo;
+	unsigned int len = 0;
+	int err;
+
+	mutex_lock(&src->rmutex);
+	mutex_lock_nested(&dst->rmutex, SINGLE_DEPTH_NESTING);
+	err = cpipe_fifo_load(src, &sfifo);
+	if (!err)
+		err = cpipe_fifo_load(dst, &dfifo);
+	if (!err)
+		err = cpipe_fifo_move_len(&dfifo, &sfifo, src->packet, &len);
+	if (!err && len) {
+		cpipe_fifo_move(&dfifo, &sfifo, len);
+		cpipe_fifo_store_out(src, &sfifo);
+		cpipe_fifo_store_in(dst, &dfifo);
+	}
+	mutex_unlock(&dst->rmutex);
+	mutex_unlock(&src->rmutex);
+	if (!len)
+		return;
+	if (cpipe_ring_is_writable(src))
+		cpipe_wake_up(&cpipe_dev_twin(src)->wq, CPIPE_POLLWR);
+	if (cpipe_ring_is_readable(dst))
+		cpipe_wake_up_readers(dst);
+}
+
+/* called with the waitqueue's lock held, so just kick the work */
+static int cpipe_fwd_wake(wait_queue_entry_t *wait, unsigned int mode,
+		int sync, void *key)
+{
+	struct cpipe_fwd *fwd = wait->private;
+
+	schedule_work(&fwd->work);
+	return 0;
+}
+
+static int cpipe_fwd_link(struct cpipe_file *cfile, struct cpipe_dev *dst)
+{
+	struct cpipe_dev *src = cfile->dev;
+	struct cpipe_dev *dev;
+	struct cpipe_fwd *fwd;
+	int err = 0;
+
+	if (src == dst)
+		return -EINVAL;
+	fwd = kzalloc(sizeof(*fwd), GFP_KERNEL);
+	if (!fwd)
+		return -ENOMEM;
+	fwd->src = src;
+	fwd->dst = dst;
+	fwd->owner = cfile;
+	INIT_WORK(&fwd->work, cpipe_fwd_work);
+	init_waitqueue_func_entry(&fwd->src_wait, cpipe_fwd_wake);
+	fwd->src_wait.private = fwd;
+	init_waitqueue_func_entry(&fwd->dst_wait, cpipe_fwd_wake);
+	fwd->dst_wait.private = fwd;
+	/* dst's file is open, so its pair is alive */
+	WARN_ON(!cpipe_pair_get(cpipe_dev_pair(dst)));
+	mutex_lock(&cpipe_fwd_mutex);
+	if (src->fwd) {
+		err = -EBUSY;
+		goto out;
+	}
+	for (dev = dst; dev; dev = dev->fwd ? dev->fwd->dst : NULL) {
+		if (dev == src) {
+			err = -ELOOP;
+			goto out;
+		}
+	}
+	mutex_lock(&src->rmutex);
+	mutex_lock_nested(&dst->rmutex, SINGLE_DEPTH_NESTING);
+	/* the data is moved as is, so both buffers must use the same format */
+	if (src->bcast || dst->bcast || src->packet != dst->packet) {
+		err = -EINVAL;
+	} else {
+		src->nfwd++;
+		dst->nfwd++;
+	}
+	mutex_unlock(&dst->rmutex);
+	mutex_unlock(&src->rmutex);
+	if (err)
+		goto out;
+	add_wait_queue(&src->rq, &fwd->src_wait);
+	add_wait_queue(&cpipe_dev_twin(dst)->wq, &fwd->dst_wait);
+	src->fwd = fwd;
+	/* move whatever is already pending */
+	schedule_work(&fwd->work);
+out:
+	mutex_unlock(&cpipe_fwd_mutex);
+	if (err) {
+		cpipe_pair_put(cpipe_dev_pair(dst));
+		kfree(fwd);
+	}
+	return err;
+}
+
+/* called with cpipe_fwd_mutex locked */
+static void cpipe_fwd_unlink(struct cpipe_dev *src)
+{
+	struct cpipe_fwd *fwd = src->fwd;
+	struct cpipe_dev *dst = fwd->dst;
+
+	src->fwd = NULL;
+	/* once off the waitqueues, the work can't be queued again */
+	remove_wait_queue(&src->rq, &fwd->src_wait);
+	remove_wait_queue(&cpipe_dev_twin(dst)->wq, &fwd->dst_wait);
+	cancel_work_sync(&fwd->work);
+	mutex_lock(&src->rmutex);
+	mutex_lock_nested(&dst->rmutex, SINGLE_DEPTH_NESTING);
+	src->nfwd--;
+	dst->nfwd--;
+	mutex_unlock(&dst->rmutex);
+	mutex_unlock(&src->rmutex);
+	cpipe_pair_put(cpipe_dev_pair(dst));
+	kfree(fwd);
+}
+
+/* links are removed along with the file that made them */
+static void cpipe_fwd_release(struct cpipe_file *cfile)
+{
+	struct cpipe_dev *src = cfile->dev;
+
+	mutex_lock(&cpipe_fwd_mutex);
+	if (src->fwd && src->fwd->owner == cfile)
+		cpipe_fwd_unlink(src);
+	mutex_unlock(&cpipe_fwd_mutex);
+}
+
+/*
+ * forward the buffer read from this end to the one written through the end
+ * open as fd, or stop forwarding it if fd is negative.
+ */
+static int cpipe_ioctl_IOCSFORWARD(struct file *filp, int __user *uptr)
+{
+	struct cpipe_dev *src = cpipe_filp_dev(filp);
+	struct fd f;
+	int fd;
+	int err;
+
+	err = get_user(fd, uptr);
+	if (err)
+		return err;
+	/* spsc readers and writers don't lock, so the link can't either */
+	if (cpipe_spsc || !(filp->f_mode & FMODE_READ))
+		return -EINVAL;
+	if (fd < 0) {
+		mutex_lock(&cpipe_fwd_mutex);
+		if (src->fwd)
+			cpipe_fwd_unlink(src);
+		mutex_unlock(&cpipe_fwd_mutex);
+		return 0;
+	}
+	f = fdget(fd);
+	if (!f.file)
+		return -EBADF;
+	if (f.file->f_op != &cpipe_fops || !(f.file->f_mode & FMODE_WRITE))
+		err = -EINVAL;
+	else
+		err = cpipe_fwd_link(filp->private_data,
+				cpipe_dev_twin(cpipe_filp_dev(f.file)));
+	fdput(f);
+	return err;
+}
+
+static int cpipe_ioctl_IOCSPKTHDR(struct cpipe_file *cfile,
+		int __user *uptr)
+{
+	int pkthdr;
+	int err;
+
+	err = get_user(pkthdr, uptr);
+	if (err)
+		return err;
+	WRITE_ONCE(cfile->pkthdr, !!pkthdr);
+	return 0;
+}
+
+static long cpipe_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+	struct cpipe_file *cfile = filp->private_data;
+	struct cpipe_dev *dev = cfile->dev;
+	long ret = 0;
+
+	if ((_IOC_TYPE(cmd) != CPIPE_IOC_MAGIC) ||
+			(_IOC_NR(cmd) > CPIPE_IOC_MAXNR))
+		return -ENOTTY;
+	switch (cmd) {
+	case CPIPE_IOCGAVAILRD:
+		ret = cpipe_ioctl_IOCGAVAILXX(&dev->rmutex,
+				dev, cpipe_fifo_len,
+				filp->f_flags, (int __user *)arg);
+		break;
+	case CPIPE_IOCGAVAILWR:
+		ret = cpipe_ioctl_IOCGAVAILXX(cpipe_dev_wmutex(dev),
+				cpipe_dev_twin(dev), cpipe_fifo_avail,
+				filp->f_flags, (int __user *)arg);
+		break;
+	case CPIPE_IOCNOTIFY:
+		/* the mapped rings were updated from userspace */
+		cpipe_wake_up_readers(cpipe_dev_twin(dev));
+		cpipe_wake_up(&cpipe_dev_twin(dev)->wq, CPIPE_POLLWR);
+		break;
+	case CPIPE_IOCGBSIZE:
+		ret = put_user(kfifo_size(&dev->rfifo), (int __user *)arg);
+		break;
+	case CPIPE_IOCSBSIZE:
+		ret = cpipe_ioctl_IOCSBSIZE(filp, (int __user *)arg);
+		break;
+	case CPIPE_IOCGPACKET:
+		ret = put_user((int)READ_ONCE(dev->packet), (int __user *)arg);
+		break;
+	case CPIPE_IOCSPACKET:
+		ret = cpipe_ioctl_IOCSPACKET(filp, (int __user *)arg);
+		break;
+	case CPIPE_IOCGRDLOWAT:
+		ret = put_user(READ_ONCE(dev->rlowat), (int __user *)arg);
+		break;
+	case CPIPE_IOCSRDLOWAT:
+		ret = cpipe_ioctl_IOCSXXLOWAT(&dev->rlowat, &dev->rq,
+				(int __user *)arg);
+		break;
+	case CPIPE_IOCGWRLOWAT:
+		ret = put_user(READ_ONCE(cpipe_dev_twin(dev)->wlowat),
+				(int __user *)arg);
+		break;
+	case CPIPE_IOCSWRLOWAT:
+		ret = cpipe_ioctl_IOCSXXLOWAT(&cpipe_dev_twin(dev)->wlowat,
+				&dev->wq, (int __user *)arg);
+		break;
+	case CPIPE_IOCGBCAST:
+		ret = put_user(READ_ONCE(dev->bcast), (int __user *)arg);
+		break;
+	case CPIPE_IOCSBCAST:
+		ret = cpipe_ioctl_IOCSBCAST(filp, (int __user *)arg);
+		break;
+	case CPIPE_IOCGNODE:
+		ret = put_user(READ_ONCE(dev->node), (int __user *)arg);
+		break;
+	case CPIPE_IOCSNODE:
+		ret = cpipe_ioctl_IOCSNODE(filp, (int __user *)arg);
+		break;
+	case CPIPE_IOCSFORWARD:
+		ret = cpipe_ioctl_IOCSFORWARD(filp, (int __user *)arg);
+		break;
+	case CPIPE_IOCGPKTHDR:
+		ret = put_user((int)READ_ONCE(cfile->pkthdr),
+				(int __user *)arg);
+		break;
+	case CPIPE_IOCSPKTHDR:
+		ret = cpipe_ioctl_IOCSPKTHDR(cfile, (int __user *)arg);
+		break;
+	default:
+		ret = -ENOTTY;
+	}
+	return ret;
+}
+
+/* a mapped buffer can't be resized, so keep track of its mappings */
+static void cpipe_vma_open(struct vm_area_struct *vma)
+{
+	struct cpipe_dev *dev = vma->vm_private_data;
+
+	atomic_inc(&dev->nmaps);
+}
+
+static void cpipe_vma_close(struct vm_area_struct *vma)
 {
-	return kfifo_len(fifo);
+	struct cpipe_dev *dev = vma->vm_private_data;
+
+	atomic_dec(&dev->nmaps);
 }
 
-/*
- * get available write write
- * called with the mutex locked
- * kfifo_avail is a macro and can't be addressed
- */
-static int cpipe_fifo_avail(struct kfifo *fifo)
+static const struct vm_operations_struct cpipe_vm_ops = {
+	.open = cpipe_vma_open,
+	.close = cpipe_vma_close,
+};
+
+static int cpipe_vm_insert_buf(struct vm_area_struct *vma,
+		unsigned long addr, void *buf, size_t size)
 {
-	return kfifo_avail(fifo);
+	int err;
+
+	for (; size; size -= PAGE_SIZE) {
+		err = vm_insert_page(vma, addr, cpipe_buf_to_page(buf));
+		if (err)
+			return err;
+		addr += PAGE_SIZE;
+		buf += PAGE_SIZE;
+	}
+	return 0;
 }
 
 /*
- * it's assumed the mutex is needed for the condition.
- * release it either way to simplify code.
+ * map a ring, header first. the offset selects the ring that's read from
+ * this end or the one written through it.
  */
-#define cpipe_wait(waitq, mutex, sleep_cond) \
-({ \
-	int __ret = 0; \
-	wait_queue_head_t *__waitq = (waitq); \
-	DEFINE_WAIT(wait); \
-	prepare_to_wait(__waitq, &wait, TASK_INTERRUPTIBLE); \
-	if (sleep_cond) { \
-		mutex_unlock(mutex); \
-		schedule(); \
-	} else \
-		mutex_unlock(mutex); \
-	finish_wait(__waitq, &wait); \
-	if (signal_pending(current)) \
-		__ret = -ERESTARTSYS; \
-	__ret; \
-})
-
-static ssize_t cpipe_read(struct file *filp, char __user *buf,
-		size_t count, loff_t *ppos)
+static int cpipe_mmap(struct file *filp, struct vm_area_struct *vma)
 {
-	struct cpipe_dev *dev = filp->private_data;
-	struct kfifo *fifo = &dev->rfifo;
-	struct mutex *mutex = &dev->rmutex;
-	ssize_t ret;
-	unsigned int copied;
-again:
-	ret = cpipe_mutex_lock(mutex, filp->f_flags);
-	if (ret)
-		return ret;
-	ret = kfifo_to_user(fifo, buf, count, &copied);
-	if (ret)
+	struct cpipe_dev *dev = cpipe_filp_dev(filp);
+	unsigned long size = vma->vm_end - vma->vm_start;
+	unsigned long data_size;
+	int err;
+
+	switch (vma->vm_pgoff << PAGE_SHIFT) {
+	case CPIPE_MMAP_RD_OFFSET:
+		if (!(filp->f_mode & FMODE_READ))
+			return -EACCES;
+		break;
+	case CPIPE_MMAP_WR_OFFSET:
+		if (!(filp->f_mode & FMODE_WRITE))
+			return -EACCES;
+		dev = cpipe_dev_twin(dev);
+		break;
+	default:
+		return -EINVAL;
+	}
+	/* keep the buffer from being replaced under us */
+	mutex_lock(&dev->rmutex);
+	/* mapped readers can't have their own cursors */
+	if (dev->bcast) {
+		err = -EINVAL;
 		goto out;
-	if (!copied) {
-		if ((filp->f_flags & O_NONBLOCK) == O_NONBLOCK) {
-			ret = -EAGAIN;
+	}
+	data_size = PAGE_ALIGN(kfifo_size(&dev->rfifo));
+	if (size > CPIPE_RING_HDR_SIZE + data_size) {
+		err = -EINVAL;
+		goto out;
+	}
+	vma->vm_flags |= VM_DONTEXPAND | VM_DONTDUMP;
+	err = cpipe_vm_insert_buf(vma, vma->vm_start, dev->ring,
+			min_t(unsigned long, size, CPIPE_RING_HDR_SIZE));
+	if (err)
+		goto out;
+	if (size > CPIPE_RING_HDR_SIZE) {
+		err = cpipe_vm_insert_buf(vma,
+				vma->vm_start + CPIPE_RING_HDR_SIZE,
+				dev->rfifo.kfifo.data,
+				size - CPIPE_RING_HDR_SIZE);
+		if (err)
 			goto out;
-		} else {
-			ret = cpipe_wait(&dev->rq, mutex,
-					kfifo_is_empty(fifo));
-			/* cpipe_wait unlocks the mutex */
-			if (ret)
-				return ret;
-			goto again;
-		}
 	}
-	/* some data was read, wake up writers waiting on this pipe */
-	wake_up_interruptible(&dev->twin->wq);
-	*ppos += copied;
-	ret = copied;
+	vma->vm_ops = &cpipe_vm_ops;
+	vma->vm_private_data = dev;
+	cpipe_vma_open(vma);
 out:
-	mutex_unlock(mutex);
-	return ret;
+	mutex_unlock(&dev->rmutex);
+	return err;
 }
 
-static ssize_t cpipe_write(struct file *filp, const char __user *buf,
-		size_t count, loff_t *ppos)
+/* take the only slot in count, locking against cpipe_realloc */
+static bool cpipe_spsc_inc(struct cpipe_dev *owner, atomic_t *count)
 {
-	struct cpipe_dev *dev = filp->private_data;
-	struct kfifo *fifo = cpipe_dev_wfifo(dev);
-	struct mutex *mutex = cpipe_dev_wmutex(dev);
-	ssize_t ret;
-	unsigned int copied;
-again:
-	ret = cpipe_mutex_lock(mutex, filp->f_flags);
-	if (ret)
-		return ret;
-	ret = kfifo_from_user(fifo, buf, count, &copied);
-	if (ret)
-		goto out;
-	if (!copied) {
-		if ((filp->f_flags & O_NONBLOCK) == O_NONBLOCK) {
-			ret = -EAGAIN;
-			goto out;
-		} else {
-			ret = cpipe_wait(&dev->wq, mutex, kfifo_is_full(fifo));
-			/* cpipe_wait unlocks the mutex */
-			if (ret)
-				return ret;
-			goto again;
-		}
+	bool ret = true;
+
+	mutex_lock(&owner->rmutex);
+	if (atomic_inc_return(count) > 1) {
+		atomic_dec(count);
+		ret = false;
 	}
-	/* some data was read, wake up readers waiting on this pipe */
-	wake_up_interruptible(&dev->twin->rq);
-	*ppos += copied;
-	ret = copied;
-out:
-	mutex_unlock(mutex);
+	mutex_unlock(&owner->rmutex);
 	return ret;
 }
 
-static unsigned int cpipe_poll(struct file *filp, poll_table *wait)
+/* in spsc mode, refuse a second reader or writer on the same fifo */
+static int cpipe_spsc_get(struct cpipe_dev *dev, fmode_t f_mode)
 {
-	struct cpipe_dev *dev = filp->private_data;
-	unsigned int mask = 0;
-	/* read */
-	if (mutex_trylock(&dev->rmutex)) {
-		if (!kfifo_is_empty(&dev->rfifo))
-			mask |= POLLIN | POLLRDNORM;
-		mutex_unlock(&dev->rmutex);
-	}
-	poll_wait(filp, &dev->rq, wait);
-	/* write */
-	if (mutex_trylock(cpipe_dev_wmutex(dev))) {
-		if (!kfifo_is_full(cpipe_dev_wfifo(dev)))
-			mask |= POLLOUT | POLLWRNORM;
-		mutex_unlock(cpipe_dev_wmutex(dev));
+	struct cpipe_dev *twin = cpipe_dev_twin(dev);
+
+	if ((f_mode & FMODE_READ) && !cpipe_spsc_inc(dev, &dev->nreaders))
+		return -EBUSY;
+	if ((f_mode & FMODE_WRITE) && !cpipe_spsc_inc(twin, &twin->nwriters)) {
+		if (f_mode & FMODE_READ)
+			atomic_dec(&dev->nreaders);
+		return -EBUSY;
 	}
-	poll_wait(filp, &dev->wq, wait);
-	return mask;
+	return 0;
+}
+
+static void cpipe_spsc_put(struct cpipe_dev *dev, fmode_t f_mode)
+{
+	if (f_mode & FMODE_READ)
+		atomic_dec(&dev->nreaders);
+	if (f_mode & FMODE_WRITE)
+		atomic_dec(&cpipe_dev_twin(dev)->nwriters);
 }
 
-static int cpipe_ioctl_IOCGAVAILXX(struct mutex *mutex, struct kfifo *fifo,
-	int (*get_availxx)(struct kfifo *), int f_flags, int __user *ret)
+static int cpipe_dev_alloc(struct cpipe_dev *dev, int node)
 {
 	int err;
 
-	err = cpipe_mutex_lock(mutex, f_flags);
-	if (err)
-		return err;
-	err = put_user(get_availxx(fifo), ret);
-	/* not checking err since there's nothing to do before returning it */
-	mutex_unlock(mutex);
+	/* the header stays put when the buffer is moved to another node */
+	dev->ring = vzalloc_node(CPIPE_RING_HDR_SIZE, node);
+	if (!dev->ring) {
+		err = -ENOMEM;
+		pr_err("failed to allocate ring for %s\n", cpipe_dev_name(dev));
+		goto fail_vzalloc_node;
+	}
+	dev->node = node;
+	err = cpipe_fifo_alloc(&dev->rfifo, cpipe_bsize, node);
+	if (err) {
+		pr_err("cpipe_fifo_alloc failed for %s. err = %d\n",
+				cpipe_dev_name(dev), err);
+		goto fail_cpipe_fifo_alloc;
+	}
+	dev->ring->size = kfifo_size(&dev->rfifo);
+	dev->ring->data_offset = CPIPE_RING_HDR_SIZE;
+	return 0;
+fail_cpipe_fifo_alloc:
+	vfree(dev->ring);
+	dev->ring = NULL;
+fail_vzalloc_node:
 	return err;
 }
 
-static long cpipe_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+static void cpipe_dev_free(struct cpipe_dev *dev)
 {
-	struct cpipe_dev *dev = filp->private_data;
-	long ret = 0;
+	cpipe_fifo_free(&dev->rfifo);
+	vfree(dev->ring);
+	dev->ring = NULL;
+}
 
-	if ((_IOC_TYPE(cmd) != CPIPE_IOC_MAGIC) ||
-			(_IOC_NR(cmd) > CPIPE_IOC_MAXNR))
-		return -ENOTTY;
-	switch (cmd) {
-	case CPIPE_IOCGAVAILRD:
-		ret = cpipe_ioctl_IOCGAVAILXX(&dev->rmutex,
-				&dev->rfifo, cpipe_fifo_len,
-				filp->f_flags, (int __user *)arg);
-		break;
-	case CPIPE_IOCGAVAILWR:
-		ret = cpipe_ioctl_IOCGAVAILXX(cpipe_dev_wmutex(dev),
-				cpipe_dev_wfifo(dev), cpipe_fifo_avail,
-				filp->f_flags, (int __user *)arg);
-		break;
-	default:
-		ret = -ENOTTY;
+/*
+ * allocate the buffers of both ends the first time the pair is opened,
+ * on the opener's node unless the node parameter says otherwise. this only
+ * saves memory for pairs that are never opened.
+ */
+static int cpipe_pair_alloc(struct cpipe_pair *pair)
+{
+	int node = cpipe_default_node();
+	int err = 0;
+	int j;
+
+	if (smp_load_acquire(&pair->allocated))
+		return 0;
+	mutex_lock(&pair->alloc_mutex);
+	if (pair->allocated)
+		goto out;
+	for (j = 0; j < ARRAY_SIZE(pair->devices); j++) {
+		err = cpipe_dev_alloc(&pair->devices[j], node);
+		if (err)
+			goto fail_cpipe_dev_alloc;
 	}
-	return ret;
+	smp_store_release(&pair->allocated, true);
+	goto out;
+fail_cpipe_dev_alloc:
+	while (j--)
+		cpipe_dev_free(&pair->devices[j]);
+out:
+	mutex_unlock(&pair->alloc_mutex);
+	return err;
 }
 
 static int cpipe_open(struct inode *inode, struct file *filp)
 {
 	unsigned int minor = iminor(inode);
-	struct cpipe_dev *dev = &cpipe_pairs[minor >> 1].devices[minor & 1];
+	struct cpipe_pair *pair;
+	struct cpipe_dev *dev;
+	struct cpipe_file *cfile;
+	unsigned long flags;
+	int err;
 
-	filp->private_data = dev;
+	spin_lock_irqsave(&cpipe_pair_ptrs_lock, flags);
+	pair = cpipe_pair_ptrs[minor >> 1];
+	if (pair && !cpipe_pair_get(pair))
+		pair = NULL;
+	spin_unlock_irqrestore(&cpipe_pair_ptrs_lock, flags);
+	if (!pair)
+		return -ENODEV;
+	err = cpipe_pair_alloc(pair);
+	if (err)
+		goto fail;
+	dev = &pair->devices[minor & 1];
+	if (cpipe_spsc) {
+		err = cpipe_spsc_get(dev, filp->f_mode);
+		if (err)
+			goto fail;
+	}
+	cfile = kmalloc(sizeof(*cfile), GFP_KERNEL);
+	if (!cfile) {
+		err = -ENOMEM;
+		goto fail_kmalloc;
+	}
+	cfile->dev = dev;
+	cfile->pkthdr = false;
+	INIT_LIST_HEAD(&cfile->cursor_link);
+	if (filp->f_mode & FMODE_READ) {
+		/* new readers only see data written after they joined */
+		mutex_lock(&dev->rmutex);
+		cfile->pos = READ_ONCE(dev->ring->in);
+		list_add_tail(&cfile->cursor_link, &dev->cursors);
+		mutex_unlock(&dev->rmutex);
+	}
+	filp->private_data = cfile;
+#ifdef FMODE_NOWAIT
+	/* reads and writes never block when asked not to */
+	filp->f_mode |= FMODE_NOWAIT;
+#endif
 	return 0;
+fail_kmalloc:
+	if (cpipe_spsc)
+		cpipe_spsc_put(dev, filp->f_mode);
+fail:
+	cpipe_pair_put(pair);
+	return err;
+}
+
+/* the data only this reader was holding back can be dropped */
+static void cpipe_cursor_del(struct cpipe_file *cfile)
+{
+	struct cpipe_dev *dev = cfile->dev;
+	struct kfifo fifo;
+
+	mutex_lock(&dev->rmutex);
+	list_del(&cfile->cursor_link);
+	if (dev->bcast && !cpipe_fifo_load(dev, &fifo)) {
+		cpipe_bcast_trim(dev, &fifo);
+		cpipe_fifo_store_out(dev, &fifo);
+	}
+	mutex_unlock(&dev->rmutex);
+	if (cpipe_ring_is_writable(dev))
+		cpipe_wake_up(&cpipe_dev_twin(dev)->wq, CPIPE_POLLWR);
 }
 
 static int cpipe_release(struct inode *inode, struct file *filp)
 {
+	struct cpipe_file *cfile = filp->private_data;
+	struct cpipe_dev *dev = cfile->dev;
+
+	if (filp->f_mode & FMODE_READ) {
+		cpipe_fwd_release(cfile);
+		cpipe_cursor_del(cfile);
+	}
+	if (cpipe_spsc)
+		cpipe_spsc_put(dev, filp->f_mode);
 	filp->private_data = NULL;
+	kfree(cfile);
+	cpipe_pair_put(cpipe_dev_pair(dev));
 	return 0;
 }
 
 static const struct file_operations cpipe_fops = {
 	.owner = THIS_MODULE,
 	.llseek = no_llseek,
-	.read = cpipe_read,
-	.write = cpipe_write,
+	.read_iter = cpipe_read_iter,
+	.write_iter = cpipe_write_iter,
+	.splice_read = cpipe_splice_read,
+	.splice_write = cpipe_splice_write,
 	.poll = cpipe_poll,
 	.unlocked_ioctl = cpipe_ioctl,
+	.mmap = cpipe_mmap,
 	.open = cpipe_open,
 	.release = cpipe_release,
 };
 
-static int __init cpipe_dev_init(struct cpipe_dev *dev, int i, int j)
+static u64 cpipe_stats_sum(struct cpipe_dev *dev, size_t offset)
+{
+	u64 sum = 0;
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		sum += *(u64 *)((char *)per_cpu_ptr(dev->stats, cpu) + offset);
+	return sum;
+}
+
+#define CPIPE_STATS_ATTR(name, field) \
+static ssize_t name##_show(struct device *d, \
+		struct device_attribute *attr, char *buf) \
+{ \
+	return sprintf(buf, "%llu\n", cpipe_stats_sum(dev_get_drvdata(d), \
+			offsetof(struct cpipe_stats, field))); \
+} \
+static DEVICE_ATTR_RO(name)
+
+CPIPE_STATS_ATTR(bytes_read, rbytes);
+CPIPE_STATS_ATTR(bytes_written, wbytes);
+CPIPE_STATS_ATTR(msgs_read, rmsgs);
+CPIPE_STATS_ATTR(msgs_written, wmsgs);
+CPIPE_STATS_ATTR(read_blocks, rblocks);
+CPIPE_STATS_ATTR(write_blocks, wblocks);
+CPIPE_STATS_ATTR(read_eagains, reagains);
+CPIPE_STATS_ATTR(write_eagains, weagains);
+
+/* one count per eighth of the buffer, from empty to full */
+static ssize_t fill_histogram_show(struct device *d,
+		struct device_attribute *attr, char *buf)
+{
+	struct cpipe_dev *dev = dev_get_drvdata(d);
+	ssize_t len = 0;
+	int i;
+
+	for (i = 0; i < CPIPE_STATS_FILL_BUCKETS; i++)
+		len += sprintf(buf + len, "%s%llu", i ? " " : "",
+				cpipe_stats_sum(dev,
+					offsetof(struct cpipe_stats, fill[i])));
+	len += sprintf(buf + len, "\n");
+	return len;
+}
+static DEVICE_ATTR_RO(fill_histogram);
+
+static struct attribute *cpipe_dev_attrs[] = {
+	&dev_attr_bytes_read.attr,
+	&dev_attr_bytes_written.attr,
+	&dev_attr_msgs_read.attr,
+	&dev_attr_msgs_written.attr,
+	&dev_attr_read_blocks.attr,
+	&dev_attr_write_blocks.attr,
+	&dev_attr_read_eagains.attr,
+	&dev_attr_write_eagains.attr,
+	&dev_attr_fill_histogram.attr,
+	NULL,
+};
+ATTRIBUTE_GROUPS(cpipe_dev);
+
+static int cpipe_dev_init(struct cpipe_dev *dev, int i, int j)
 {
 	int err;
 	dev_t devno = MKDEV(cpipe_major, i * 2 + j);
 
-	err = kfifo_alloc(&dev->rfifo, cpipe_bsize, GFP_KERNEL);
-	if (err) {
-		pr_err("kfifo_alloc failed i=%d j=%d err=%d\n", i, j, err);
-		goto fail_kfifo_alloc;
-	}
 	mutex_init(&dev->rmutex);
+	INIT_LIST_HEAD(&dev->cursors);
+	dev->rlowat = 1;
+	dev->wlowat = 1;
+	atomic_set(&dev->nreaders, 0);
+	atomic_set(&dev->nwriters, 0);
+	atomic_set(&dev->nmaps, 0);
 	init_waitqueue_head(&dev->rq);
 	init_waitqueue_head(&dev->wq);
+	/* the stats attributes show up with the device */
+	dev->stats = alloc_percpu(struct cpipe_stats);
+	if (!dev->stats) {
+		err = -ENOMEM;
+		pr_err("alloc_percpu failed i=%d j=%d\n", i, j);
+		goto fail_alloc_percpu;
+	}
 	dev->dev = device_create(cpipe_class, NULL, devno, dev,
 			"%s%d.%d", KBUILD_MODNAME, i, j);
 	if (IS_ERR(dev->dev)) {
@@ -300,8 +2022,8 @@ static int __init cpipe_dev_init(struct cpipe_dev *dev, int i, int j)
 	pr_info("created device %s successfully\n", cpipe_dev_name(dev));
 	return 0;
 fail_device_create:
-	kfifo_free(&dev->rfifo);
-fail_kfifo_alloc:
+	free_percpu(dev->stats);
+fail_alloc_percpu:
 	return err;
 }
 
@@ -309,10 +2031,11 @@ static void cpipe_dev_destroy(struct cpipe_dev *dev)
 {
 	pr_info("destroying device %s\n", cpipe_dev_name(dev));
 	device_destroy(cpipe_class, cpipe_dev_devt(dev));
-	kfifo_free(&dev->rfifo);
+	cpipe_dev_free(dev);
+	free_percpu(dev->stats);
 }
 
-static int __init cpipe_pair_init(struct cpipe_pair *pair, int i)
+static int cpipe_pair_init(struct cpipe_pair *pair, int i)
 {
 	int err;
 	int j;
@@ -350,12 +2073,11 @@ fail_cpipe_dev_init:
 	return err;
 }
 
-static void cpipe_pair_destroy(struct cpipe_pair *pair)
+static void cpipe_pair_deinit(struct cpipe_pair *pair)
 {
-	int i, j;
+	int j;
 
-	i = MINOR(cpipe_dev_devt(&pair->devices[0])) / 2;
-	pr_info("destroying pair %s%d\n", KBUILD_MODNAME, i);
+	pr_info("destroying pair %s%d\n", KBUILD_MODNAME, pair->index);
 	for (j = 0; j < ARRAY_SIZE(pair->devices); j++) {
 		sysfs_remove_link(cpipe_dev_kobj(&pair->devices[j]),
 				cpipe_twin_link_name);
@@ -363,24 +2085,262 @@ static void cpipe_pair_destroy(struct cpipe_pair *pair)
 	}
 }
 
+/* pairs created at load time have no master and live until unload */
+static struct cpipe_pair *cpipe_pair_create(struct cpipe_master *master)
+{
+	int i;
+	int err;
+	unsigned long flags;
+	struct cpipe_pair *pair;
+
+	pair = kzalloc(sizeof(*pair), GFP_KERNEL);
+	if (!pair) {
+		err = -ENOMEM;
+		pr_err("<%s> failed to allocate pair\n", __func__);
+		goto fail_kzalloc_pair;
+	}
+
+	/* the pair can't be opened until its kref is initialized */
+	spin_lock_irqsave(&cpipe_pair_ptrs_lock, flags);
+	for (i = 0; i < cpipe_max_pipes && cpipe_pair_ptrs[i]; i++)
+		;
+	if (i == cpipe_max_pipes) {
+		err = -ENODEV;
+		pr_err("<%s> all pipes are occupied\n", __func__);
+		spin_unlock_irqrestore(&cpipe_pair_ptrs_lock, flags);
+		goto fail_find_index;
+	}
+	cpipe_pair_ptrs[i] = pair;
+	spin_unlock_irqrestore(&cpipe_pair_ptrs_lock, flags);
+
+	pair->index = i;
+	mutex_init(&pair->alloc_mutex);
+	spin_lock_init(&pair->master_lock);
+	INIT_LIST_HEAD(&pair->master_link);
+	err = cpipe_pair_init(pair, i);
+	if (err)
+		goto fail_cpipe_pair_init;
+
+	pair->master = master;
+	if (master) {
+		spin_lock_irqsave(&master->pairs_list_lock, flags);
+		list_add(&pair->master_link, &master->pairs_list);
+		spin_unlock_irqrestore(&master->pairs_list_lock, flags);
+	}
+	smp_wmb();
+	kref_init(&pair->kref);
+	return pair;
+
+fail_cpipe_pair_init:
+	spin_lock_irqsave(&cpipe_pair_ptrs_lock, flags);
+	cpipe_pair_ptrs[i] = NULL;
+	spin_unlock_irqrestore(&cpipe_pair_ptrs_lock, flags);
+fail_find_index:
+	kfree(pair);
+fail_kzalloc_pair:
+	return ERR_PTR(err);
+}
+
+static void cpipe_pair_destroy(struct cpipe_pair *pair)
+{
+	unsigned long flags, flags2;
+
+	spin_lock_irqsave(&pair->master_lock, flags);
+	if (pair->master) {
+		spin_lock_irqsave(&pair->master->pairs_list_lock, flags2);
+		list_del(&pair->master_link);
+		spin_unlock_irqrestore(&pair->master->pairs_list_lock,
+				flags2);
+	}
+	spin_unlock_irqrestore(&pair->master_lock, flags);
+
+	cpipe_pair_deinit(pair);
+
+	spin_lock_irqsave(&cpipe_pair_ptrs_lock, flags);
+	cpipe_pair_ptrs[pair->index] = NULL;
+	spin_unlock_irqrestore(&cpipe_pair_ptrs_lock, flags);
+
+	kfree(pair);
+}
+
+static void cpipe_pair_kref_release(struct kref *kref)
+{
+	cpipe_pair_destroy(container_of(kref, struct cpipe_pair, kref));
+}
+
+/*
+ * detach the pair from master if it's still the pair's master.
+ * the caller is then responsible for the master's reference.
+ */
+static int cpipe_pair_detach(struct cpipe_pair *pair,
+		struct cpipe_master *master)
+{
+	unsigned long flags, flags2;
+	int err = 0;
+
+	spin_lock_irqsave(&pair->master_lock, flags);
+	if (master == pair->master) {
+		spin_lock_irqsave(&master->pairs_list_lock, flags2);
+		list_del(&pair->master_link);
+		spin_unlock_irqrestore(&master->pairs_list_lock, flags2);
+		pair->master = NULL;
+	} else
+		err = -EPERM;
+	spin_unlock_irqrestore(&pair->master_lock, flags);
+	return err;
+}
+
+static int cpipe_miscdev_open(struct inode *inode, struct file *filp)
+{
+	struct cpipe_master *master;
+
+	master = kmalloc(sizeof(*master), GFP_KERNEL);
+	if (!master)
+		return -ENOMEM;
+	INIT_LIST_HEAD(&master->pairs_list);
+	spin_lock_init(&master->pairs_list_lock);
+	filp->private_data = master;
+	return 0;
+}
+
+static int cpipe_miscdev_release(struct inode *inode, struct file *filp)
+{
+	struct cpipe_master *master = filp->private_data;
+	struct cpipe_pair *pair;
+	unsigned long flags;
+
+	spin_lock_irqsave(&master->pairs_list_lock, flags);
+	while (!list_empty(&master->pairs_list)) {
+		pair = list_first_entry(&master->pairs_list,
+				struct cpipe_pair, master_link);
+		spin_unlock_irqrestore(&master->pairs_list_lock, flags);
+		if (!cpipe_pair_detach(pair, master))
+			cpipe_pair_put(pair);
+		spin_lock_irqsave(&master->pairs_list_lock, flags);
+	}
+	spin_unlock_irqrestore(&master->pairs_list_lock, flags);
+	kfree(master);
+	filp->private_data = NULL;
+	return 0;
+}
+
+static int cpipe_miscdev_ioctl_create(struct cpipe_master *master,
+		unsigned int __user *uptr)
+{
+	struct cpipe_pair *pair;
+	int err;
+
+	pair = cpipe_pair_create(master);
+	if (IS_ERR(pair))
+		return PTR_ERR(pair);
+	err = put_user(pair->index, uptr);
+	if (err && !cpipe_pair_detach(pair, master))
+		cpipe_pair_put(pair);
+	return err;
+}
+
+static int cpipe_miscdev_ioctl_destroy(struct cpipe_master *master,
+		const unsigned int __user *uptr)
+{
+	struct cpipe_pair *pair = NULL;
+	unsigned int index;
+	unsigned long flags;
+	int err;
+
+	err = get_user(index, uptr);
+	if (err)
+		return err;
+	spin_lock_irqsave(&cpipe_pair_ptrs_lock, flags);
+	if (index < cpipe_max_pipes) {
+		pair = cpipe_pair_ptrs[index];
+		if (pair && !cpipe_pair_get(pair))
+			pair = NULL;
+	}
+	spin_unlock_irqrestore(&cpipe_pair_ptrs_lock, flags);
+	if (!pair) {
+		pr_err("<%s> cannot destroy nonexisting pair %s%u\n",
+				__func__, KBUILD_MODNAME, index);
+		return -EINVAL;
+	}
+	err = cpipe_pair_detach(pair, master);
+	if (err)
+		pr_err("<%s> invalid master to destroy pair %s%u\n",
+				__func__, KBUILD_MODNAME, index);
+	else
+		/* drop the master's reference */
+		cpipe_pair_put(pair);
+	cpipe_pair_put(pair);
+	return err;
+}
+
+static long cpipe_miscdev_ioctl(struct file *filp,
+		unsigned int cmd, unsigned long arg)
+{
+	struct cpipe_master *master = filp->private_data;
+	long ret = 0;
+
+	if ((_IOC_TYPE(cmd) != CPIPE_CTL_IOC_MAGIC) ||
+			(_IOC_NR(cmd) > CPIPE_CTL_IOC_MAXNR))
+		return -ENOTTY;
+	switch (cmd) {
+	case CPIPE_CTL_IOCCREATE:
+		ret = cpipe_miscdev_ioctl_create(master,
+				(unsigned int __user *)arg);
+		break;
+	case CPIPE_CTL_IOCDESTROY:
+		ret = cpipe_miscdev_ioctl_destroy(master,
+				(const unsigned int __user *)arg);
+		break;
+	default:
+		ret = -ENOTTY;
+	}
+	return ret;
+}
+
+static const struct file_operations cpipe_miscdev_fops = {
+	.owner = THIS_MODULE,
+	.open = cpipe_miscdev_open,
+	.release = cpipe_miscdev_release,
+	.unlocked_ioctl = cpipe_miscdev_ioctl,
+};
+
+static struct miscdevice cpipe_miscdev = {
+	.minor = MISC_DYNAMIC_MINOR,
+	.name = KBUILD_MODNAME,
+	.fops = &cpipe_miscdev_fops,
+};
+
+/* only pairs created at load time are left by now */
+static void cpipe_put_all_pairs(void)
+{
+	int i;
+
+	for (i = 0; i < cpipe_max_pipes; i++)
+		if (cpipe_pair_ptrs[i])
+			cpipe_pair_put(cpipe_pair_ptrs[i]);
+}
+
 static int __init cpipe_init(void)
 {
 	int err;
 	int i;
+	struct cpipe_pair *pair;
 
 	pr_info("in %s\n", __func__);
 	err = cpipe_check_module_params();
 	if (err)
 		return err;
-	cpipe_pairs = vmalloc(sizeof(cpipe_pairs[0]) * cpipe_npipes);
-	if (!cpipe_pairs) {
+	cpipe_pair_ptrs = vmalloc(sizeof(cpipe_pair_ptrs[0]) *
+			cpipe_max_pipes);
+	if (!cpipe_pair_ptrs) {
 		err = -ENOMEM;
-		pr_err("failed to allocate cpipe_pairs\n");
-		goto fail_vmalloc_cpipe_pairs;
+		pr_err("failed to allocate cpipe_pair_ptrs\n");
+		goto fail_vmalloc_cpipe_pair_ptrs;
 	}
-	memset(cpipe_pairs, 0, sizeof(cpipe_pairs[0]) * cpipe_npipes);
-	cpipe_major = __register_chrdev(0, 0, cpipe_npipes * 2, KBUILD_MODNAME,
-			&cpipe_fops);
+	memset(cpipe_pair_ptrs, 0, sizeof(cpipe_pair_ptrs[0]) *
+			cpipe_max_pipes);
+	cpipe_major = __register_chrdev(0, 0, cpipe_max_pipes * 2,
+			KBUILD_MODNAME, &cpipe_fops);
 	if (cpipe_major < 0) {
 		err = cpipe_major;
 		pr_err("__register_chrdev failed. err = %d\n", err);
@@ -392,38 +2352,45 @@ static int __init cpipe_init(void)
 		pr_err("class_create failed. err = %d\n", err);
 		goto fail_class_create;
 	}
+	cpipe_class->dev_groups = cpipe_dev_groups;
 	for (i = 0; i < cpipe_npipes; i++) {
-		err = cpipe_pair_init(&cpipe_pairs[i], i);
-		if (err) {
-			pr_err("cpipe_pair_init failed. i = %d, err = %d\n",
+		pair = cpipe_pair_create(NULL);
+		if (IS_ERR(pair)) {
+			err = PTR_ERR(pair);
+			pr_err("cpipe_pair_create failed. i = %d, err = %d\n",
 					i, err);
-			goto fail_cpipe_pair_init_loop;
+			goto fail_cpipe_pair_create_loop;
 		}
 	}
+	err = misc_register(&cpipe_miscdev);
+	if (err) {
+		pr_err("misc_register failed. err = %d\n", err);
+		goto fail_misc_register;
+	}
 	pr_info("initializated successfully\n");
 	return 0;
-fail_cpipe_pair_init_loop:
-	while (i--)
-		cpipe_pair_destroy(&cpipe_pairs[i]);
+fail_misc_register:
+fail_cpipe_pair_create_loop:
+	cpipe_put_all_pairs();
 	class_destroy(cpipe_class);
 fail_class_create:
-	__unregister_chrdev(cpipe_major, 0, cpipe_npipes * 2, KBUILD_MODNAME);
+	__unregister_chrdev(cpipe_major, 0, cpipe_max_pipes * 2,
+			KBUILD_MODNAME);
 fail_register_chrdev:
-	vfree(cpipe_pairs);
-fail_vmalloc_cpipe_pairs:
+	vfree(cpipe_pair_ptrs);
+fail_vmalloc_cpipe_pair_ptrs:
 	return err;
 }
 module_init(cpipe_init);
 
 static void __exit cpipe_exit(void)
 {
-	int i;
-
-	for (i = 0; i < cpipe_npipes; i++)
-		cpipe_pair_destroy(&cpipe_pairs[i]);
+	misc_deregister(&cpipe_miscdev);
+	cpipe_put_all_pairs();
 	class_destroy(cpipe_class);
-	__unregister_chrdev(cpipe_major, 0, cpipe_npipes * 2, KBUILD_MODNAME);
-	vfree(cpipe_pairs);
+	__unregister_chrdev(cpipe_major, 0, cpipe_max_pipes * 2,
+			KBUILD_MODNAME);
+	vfree(cpipe_pair_ptrs);
 	pr_info("exited successfully\n");
 }
 module_exit(cpipe_exit);
@@ -432,4 +2399,4 @@ module_exit(cpipe_exit);
 LMOD_MODULE_AUTHOR();
 LMOD_MODULE_LICENSE();
 MODULE_DESCRIPTION("Pairs of char devices acting as pipes");
-MODULE_VERSION("1.2.1");
+MODULE_VERSION("1.16.0");
@@ -2,10 +2,110 @@
 #define _CPIPE_IOCTL_H
 
 #include <linux/ioctl.h>
+#include <linux/types.h>
 
 #define CPIPE_IOC_MAGIC 'p'
 #define CPIPE_IOCGAVAILRD _IOR(CPIPE_IOC_MAGIC, 0, int)
 #define CPIPE_IOCGAVAILWR _IOR(CPIPE_IOC_MAGIC, 1, int)
-#define CPIPE_IOC_MAXNR 1
+#define CPIPE_IOCNOTIFY   _IO(CPIPE_IOC_MAGIC, 2)
+/* size of the buffer read from an end, rounded up to a power of two */
+#define CPIPE_IOCGBSIZE   _IOR(CPIPE_IOC_MAGIC, 3, int)
+#define CPIPE_IOCSBSIZE   _IOWR(CPIPE_IOC_MAGIC, 4, int)
+/*
+ * packet mode of the buffer read from an end. can only be changed while the
+ * buffer is empty and unmapped.
+ */
+#define CPIPE_IOCGPACKET  _IOR(CPIPE_IOC_MAGIC, 5, int)
+#define CPIPE_IOCSPACKET  _IOW(CPIPE_IOC_MAGIC, 6, int)
+/*
+ * watermarks, in bytes, of the buffers read from and written through an end.
+ * blocking readers, poll and epoll only see the buffer as readable once
+ * RDLOWAT bytes are queued, and as writable once WRLOWAT bytes are free.
+ * both are clamped to the buffer size and default to 1. in packet mode,
+ * RDLOWAT is also kept low enough that a buffer too full to take the
+ * largest message counts as readable.
+ */
+#define CPIPE_IOCGRDLOWAT _IOR(CPIPE_IOC_MAGIC, 7, int)
+#define CPIPE_IOCSRDLOWAT _IOW(CPIPE_IOC_MAGIC, 8, int)
+#define CPIPE_IOCGWRLOWAT _IOR(CPIPE_IOC_MAGIC, 9, int)
+#define CPIPE_IOCSWRLOWAT _IOW(CPIPE_IOC_MAGIC, 10, int)
+/*
+ * broadcast mode of the buffer read from an end, one of CPIPE_BCAST_*.
+ * can only be changed while no data is pending for its readers, and the
+ * buffer is unmapped.
+ */
+#define CPIPE_IOCGBCAST   _IOR(CPIPE_IOC_MAGIC, 11, int)
+#define CPIPE_IOCSBCAST   _IOW(CPIPE_IOC_MAGIC, 12, int)
+/*
+ * numa node of the buffer read from an end. setting it moves the buffer,
+ * which has to be unmapped. -1 selects the node of the calling cpu.
+ */
+#define CPIPE_IOCGNODE    _IOR(CPIPE_IOC_MAGIC, 13, int)
+#define CPIPE_IOCSNODE    _IOWR(CPIPE_IOC_MAGIC, 14, int)
+/*
+ * move everything queued in the buffer read from an end into the buffer
+ * written through the end open as the given fd, from inside the kernel.
+ * writers block when both buffers are full. a negative fd stops forwarding,
+ * and so does closing the file that started it. both buffers must be in the
+ * same mode, and not broadcast.
+ */
+#define CPIPE_IOCSFORWARD _IOW(CPIPE_IOC_MAGIC, 15, int)
+/*
+ * whether reads through this file from a packet mode buffer return whole
+ * messages, each preceded by its header, as many as fit. a read too short
+ * for the next message fails with EMSGSIZE. without it, readv can only
+ * batch messages of the same length.
+ */
+#define CPIPE_IOCGPKTHDR  _IOR(CPIPE_IOC_MAGIC, 16, int)
+#define CPIPE_IOCSPKTHDR  _IOW(CPIPE_IOC_MAGIC, 17, int)
+#define CPIPE_IOC_MAXNR 17
+
+/* ioctls on the control device, taking pipe numbers */
+#define CPIPE_CTL_IOC_MAGIC 'P'
+#define CPIPE_CTL_IOCCREATE  _IOR(CPIPE_CTL_IOC_MAGIC, 0, unsigned int)
+#define CPIPE_CTL_IOCDESTROY _IOW(CPIPE_CTL_IOC_MAGIC, 1, unsigned int)
+#define CPIPE_CTL_IOC_MAXNR 1
+
+/*
+ * mmap offsets selecting the ring read from an end or the one written
+ * through it. a mapping always starts at the ring header.
+ */
+#define CPIPE_MMAP_RD_OFFSET 0x00000000
+#define CPIPE_MMAP_WR_OFFSET 0x10000000
+
+/*
+ * in packet mode, each write (or each segment of writev) is one message,
+ * and each read (or each segment of readv) returns at most one message.
+ * a message shorter than its segment ends a readv, see CPIPE_IOCSPKTHDR.
+ * in a mapped ring, and in reads with CPIPE_IOCSPKTHDR set, every message
+ * is preceded by its length in little endian.
+ */
+#define CPIPE_PACKET_HDR_SIZE 2
+#define CPIPE_PACKET_MAX 0xffff
+
+/*
+ * in broadcast mode, every file reading a buffer gets all the data written
+ * to it after the file was opened. when the slowest reader falls a buffer
+ * behind, writers either block or drop the oldest data, skipping readers
+ * ahead. broadcast buffers can't be mapped.
+ */
+#define CPIPE_BCAST_OFF 0
+#define CPIPE_BCAST_BLOCK 1
+#define CPIPE_BCAST_OVERWRITE 2
+
+/*
+ * header of a mapped ring. in and out are free running and masked by
+ * size - 1 to index the data, which starts data_offset bytes into the
+ * mapping. after advancing an index, use CPIPE_IOCNOTIFY to wake up the
+ * other side.
+ */
+struct cpipe_ring {
+	__u32 in; /* advanced by the producer */
+	__u8 __pad_in[60];
+	__u32 out; /* advanced by the consumer */
+	__u8 __pad_out[60];
+	__u32 size;
+	__u32 data_offset;
+};
 
 #endif /* _CPIPE_IOCTL_H */
@@ -0,0 +1,794 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <poll.h>
+
+#include "cpipe_ioctl.h"
+
+#define MODULE_NAME "cpipe"
+/* data written through end 1 is read from end 0 */
+#define CPIPE_SINK "/dev/" MODULE_NAME "0.0"
+#define CPIPE_SOURCE "/dev/" MODULE_NAME "0.1"
+#define CPIPE_CTL "/dev/" MODULE_NAME
+#define CPIPE_END_NAME_LEN (sizeof(CPIPE_CTL) + 16)
+#define CPIPE_SPSC_PARAM "/sys/module/" MODULE_NAME "/parameters/spsc"
+
+static inline void cpipe_delay(void)
+{
+	usleep(10000);
+}
+
+/* a pair of its own for each test, destroyed when ctl is closed */
+static int create_pair(int *ctl, unsigned int *index)
+{
+	*ctl = open(CPIPE_CTL, O_RDONLY);
+	if (*ctl < 0) {
+		perror("Failed to open control device");
+		return 1;
+	}
+	if (ioctl(*ctl, CPIPE_CTL_IOCCREATE, index) < 0) {
+		perror("Failed to create pair");
+		close(*ctl);
+		return 1;
+	}
+	return 0;
+}
+
+static void close_ctl(int ctl)
+{
+	close(ctl);
+	cpipe_delay();
+}
+
+static inline void end_name(char *buf, unsigned int index, int end)
+{
+	sprintf(buf, "%s%u.%d", CPIPE_CTL, index, end);
+}
+
+static int open_end(unsigned int index, int end, int flags)
+{
+	char buf[CPIPE_END_NAME_LEN];
+	int fd;
+
+	end_name(buf, index, end);
+	fd = open(buf, flags);
+	if (fd < 0)
+		perror("Failed to open end");
+	return fd;
+}
+
+static int end_exists(unsigned int index, int end)
+{
+	char buf[CPIPE_END_NAME_LEN];
+
+	end_name(buf, index, end);
+	return access(buf, F_OK) == 0;
+}
+
+/* broadcast and forwarding are refused in spsc mode */
+static int spsc_mode(void)
+{
+	char c = 'N';
+	FILE *f;
+
+	f = fopen(CPIPE_SPSC_PARAM, "r");
+	if (!f)
+		return 0;
+	if (fscanf(f, "%c", &c) != 1)
+		c = 'N';
+	fclose(f);
+	return c == 'Y';
+}
+
+static int read_expect(int fd, const char *expected)
+{
+	char buf[64];
+	ssize_t len = strlen(expected);
+
+	if (read(fd, buf, len) != len || memcmp(buf, expected, len)) {
+		fprintf(stderr, "Did not read back \"%s\"\n", expected);
+		return 1;
+	}
+	return 0;
+}
+
+/* copy to and from a mapped ring, as a peer without syscalls would */
+static void ring_put(struct cpipe_ring *ring, const char *buf, size_t len)
+{
+	char *data = (char *)ring + ring->data_offset;
+	__u32 in = ring->in;
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		data[(in + i) & (ring->size - 1)] = buf[i];
+	__atomic_store_n(&ring->in, in + len, __ATOMIC_RELEASE);
+}
+
+static void ring_get(struct cpipe_ring *ring, char *buf, size_t len)
+{
+	char *data = (char *)ring + ring->data_offset;
+	__u32 out = ring->out;
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		buf[i] = data[(out + i) & (ring->size - 1)];
+	__atomic_store_n(&ring->out, out + len, __ATOMIC_RELEASE);
+}
+
+/* a packet mode sink whose buffer can hold more than CPIPE_PACKET_MAX */
+static int open_big_packet_pipe(int *snk, int *src)
+{
+	int size = 4 * (CPIPE_PACKET_MAX + 1);
+	int packet = 1;
+
+	*snk = open(CPIPE_SINK, O_RDONLY | O_NONBLOCK);
+	if (*snk < 0) {
+		perror("Failed to open sink");
+		return 1;
+	}
+	if (ioctl(*snk, CPIPE_IOCSBSIZE, &size) < 0) {
+		perror("Failed to resize sink");
+		goto out_close_snk;
+	}
+	if (ioctl(*snk, CPIPE_IOCSPACKET, &packet) < 0) {
+		perror("Failed to set packet mode");
+		goto out_close_snk;
+	}
+	*src = open(CPIPE_SOURCE, O_WRONLY | O_NONBLOCK);
+	if (*src < 0) {
+		perror("Failed to open source");
+		goto out_close_snk;
+	}
+	return 0;
+out_close_snk:
+	close(*snk);
+	return 1;
+}
+
+/* actual tests */
+
+static int test_writev_stops_before_oversized_segment(void)
+{
+	int snk, src;
+	char small[] = "hello";
+	size_t biglen = CPIPE_PACKET_MAX + 1;
+	char *big, readback[sizeof(small)];
+	struct iovec iov[2];
+	int ret = 1;
+
+	big = calloc(1, biglen);
+	if (!big)
+		return 1;
+	if (open_big_packet_pipe(&snk, &src))
+		goto out_free;
+	iov[0].iov_base = small;
+	iov[0].iov_len = sizeof(small);
+	iov[1].iov_base = big;
+	iov[1].iov_len = biglen;
+	if (writev(src, iov, 2) != sizeof(small)) {
+		perror("Unexpected writev result with an oversized segment");
+		goto out_close;
+	}
+	/* nothing before it this time */
+	if (writev(src, &iov[1], 1) >= 0 || errno != EMSGSIZE) {
+		fprintf(stderr, "Oversized message was not rejected\n");
+		goto out_close;
+	}
+	if (read(snk, readback, sizeof(readback)) != sizeof(small) ||
+			memcmp(small, readback, sizeof(small))) {
+		fprintf(stderr, "Failed to read back the first message\n");
+		goto out_close;
+	}
+	/* the framing is intact, nothing else was queued */
+	if (read(snk, readback, sizeof(readback)) >= 0 || errno != EAGAIN) {
+		fprintf(stderr, "Unexpected data after the first message\n");
+		goto out_close;
+	}
+	ret = 0;
+out_close:
+	close(src);
+	close(snk);
+out_free:
+	free(big);
+	return ret;
+}
+
+static int test_pkthdr_reads_batch_messages(void)
+{
+	int snk, src;
+	char *msgs[] = { "a", "bcd", "efghij" };
+	int nmsgs = sizeof(msgs) / sizeof(msgs[0]);
+	char buf[64], *p;
+	char big[10] = { 0 };
+	int pkthdr = 1;
+	size_t len;
+	ssize_t n;
+	int i, ret = 1;
+
+	if (open_big_packet_pipe(&snk, &src))
+		return 1;
+	if (ioctl(snk, CPIPE_IOCSPKTHDR, &pkthdr) < 0) {
+		perror("Failed to set pkthdr");
+		goto out_close;
+	}
+	for (i = 0; i < nmsgs; i++)
+		if (write(src, msgs[i], strlen(msgs[i])) != strlen(msgs[i])) {
+			perror("Failed to write message");
+			goto out_close;
+		}
+	/* all of them in one read, each with its length */
+	n = read(snk, buf, sizeof(buf));
+	p = buf;
+	for (i = 0; i < nmsgs; i++) {
+		len = strlen(msgs[i]);
+		if (p + CPIPE_PACKET_HDR_SIZE + len > buf + n ||
+				p[0] != len || p[1] != 0 ||
+				memcmp(p + CPIPE_PACKET_HDR_SIZE, msgs[i], len)) {
+			fprintf(stderr, "Bad message %d in batch\n", i);
+			goto out_close;
+		}
+		p += CPIPE_PACKET_HDR_SIZE + len;
+	}
+	if (p != buf + n) {
+		fprintf(stderr, "Unexpected data after batch\n");
+		goto out_close;
+	}
+	/* messages are never cut */
+	if (write(src, big, sizeof(big)) != sizeof(big)) {
+		perror("Failed to write message");
+		goto out_close;
+	}
+	if (read(snk, buf, sizeof(big)) >= 0 || errno != EMSGSIZE) {
+		fprintf(stderr, "Short read did not fail with EMSGSIZE\n");
+		goto out_close;
+	}
+	if (read(snk, buf, sizeof(buf)) !=
+			CPIPE_PACKET_HDR_SIZE + sizeof(big)) {
+		fprintf(stderr, "Failed to read back the message\n");
+		goto out_close;
+	}
+	ret = 0;
+out_close:
+	close(src);
+	close(snk);
+	return ret;
+}
+
+static int test_mmap_ring_exchange(void)
+{
+	int ctl, fd0 = -1, fd1 = -1;
+	unsigned int index;
+	size_t len = 2 * sysconf(_SC_PAGESIZE);
+	struct cpipe_ring *rmap = MAP_FAILED, *wmap = MAP_FAILED;
+	struct pollfd pfd;
+	char buf[2];
+	int avail;
+	int ret = 1;
+
+	if (create_pair(&ctl, &index))
+		return 1;
+	/* shared writable mappings need both read and write access */
+	fd0 = open_end(index, 0, O_RDWR | O_NONBLOCK);
+	fd1 = open_end(index, 1, O_RDWR | O_NONBLOCK);
+	if (fd0 < 0 || fd1 < 0)
+		goto out_close;
+	/* the ring written through end 1 is the one read from end 0 */
+	wmap = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd1,
+			CPIPE_MMAP_WR_OFFSET);
+	rmap = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd0,
+			CPIPE_MMAP_RD_OFFSET);
+	if (wmap == MAP_FAILED || rmap == MAP_FAILED) {
+		perror("Failed to map ring");
+		goto out_unmap;
+	}
+	/* a mapped writer and a reader using read */
+	ring_put(wmap, "hi", 2);
+	if (ioctl(fd1, CPIPE_IOCNOTIFY) < 0) {
+		perror("Failed to notify reader");
+		goto out_unmap;
+	}
+	pfd.fd = fd0;
+	pfd.events = POLLIN;
+	if (poll(&pfd, 1, 0) != 1) {
+		fprintf(stderr, "Reader not notified of mapped write\n");
+		goto out_unmap;
+	}
+	if (read(fd0, buf, sizeof(buf)) != 2 || memcmp(buf, "hi", 2)) {
+		fprintf(stderr, "Failed to read back mapped write\n");
+		goto out_unmap;
+	}
+	/* a writer using write and a mapped reader */
+	if (write(fd1, "yo", 2) != 2) {
+		perror("Failed to write");
+		goto out_unmap;
+	}
+	if (rmap->in - rmap->out != 2) {
+		fprintf(stderr, "Write not visible in mapped ring\n");
+		goto out_unmap;
+	}
+	ring_get(rmap, buf, 2);
+	if (memcmp(buf, "yo", 2) || ioctl(fd0, CPIPE_IOCNOTIFY) < 0)
+		goto out_unmap;
+	if (ioctl(fd1, CPIPE_IOCGAVAILWR, &avail) < 0 ||
+			avail != rmap->size) {
+		fprintf(stderr, "Mapped read did not free the ring\n");
+		goto out_unmap;
+	}
+	ret = 0;
+out_unmap:
+	if (wmap != MAP_FAILED)
+		munmap(wmap, len);
+	if (rmap != MAP_FAILED)
+		munmap(rmap, len);
+out_close:
+	if (fd1 >= 0)
+		close(fd1);
+	if (fd0 >= 0)
+		close(fd0);
+	close_ctl(ctl);
+	return ret;
+}
+
+static int test_resize_keeps_data(void)
+{
+	int ctl, rfd, wfd;
+	unsigned int index;
+	char data[] = "abcdefg";
+	size_t count = strlen(data);
+	char readback[sizeof(data)];
+	int size;
+	int ret = 1;
+
+	if (create_pair(&ctl, &index))
+		return 1;
+	rfd = open_end(index, 0, O_RDONLY | O_NONBLOCK);
+	if (rfd < 0)
+		goto out_close_ctl;
+	wfd = open_end(index, 1, O_WRONLY | O_NONBLOCK);
+	if (wfd < 0)
+		goto out_close_reader;
+	if (write(wfd, data, count) != count) {
+		perror("Failed to write");
+		close(wfd);
+		goto out_close_reader;
+	}
+	/* in spsc mode, only a buffer no one else has open can be resized */
+	close(wfd);
+	size = count / 2;
+	if (ioctl(rfd, CPIPE_IOCSBSIZE, &size) >= 0 || errno != EBUSY) {
+		fprintf(stderr, "Shrinking below the data length worked\n");
+		goto out_close_reader;
+	}
+	size = 2 * count;
+	if (ioctl(rfd, CPIPE_IOCSBSIZE, &size) < 0) {
+		perror("Failed to grow buffer");
+		goto out_close_reader;
+	}
+	/* rounded up to a power of two */
+	if (size != 16 || ioctl(rfd, CPIPE_IOCGBSIZE, &size) < 0 ||
+			size != 16) {
+		fprintf(stderr, "Unexpected buffer size %d\n", size);
+		goto out_close_reader;
+	}
+	if (read(rfd, readback, sizeof(readback)) != count ||
+			memcmp(data, readback, count)) {
+		fprintf(stderr, "Data in flight was lost by resizing\n");
+		goto out_close_reader;
+	}
+	ret = 0;
+out_close_reader:
+	close(rfd);
+out_close_ctl:
+	close_ctl(ctl);
+	return ret;
+}
+
+static int test_create_destroy_pair(void)
+{
+	int ctl, other;
+	unsigned int index;
+	int ret = 1;
+
+	if (create_pair(&ctl, &index))
+		return 1;
+	if (!end_exists(index, 0) || !end_exists(index, 1)) {
+		fprintf(stderr, "Created pair has no device nodes\n");
+		goto out_close_ctl;
+	}
+	/* only the control file that created it may destroy it */
+	other = open(CPIPE_CTL, O_RDONLY);
+	if (other < 0) {
+		perror("Failed to open control device");
+		goto out_close_ctl;
+	}
+	if (ioctl(other, CPIPE_CTL_IOCDESTROY, &index) >= 0 ||
+			errno != EPERM) {
+		fprintf(stderr, "Pair destroyed by another control file\n");
+		close_ctl(other);
+		goto out_close_ctl;
+	}
+	close_ctl(other);
+	if (ioctl(ctl, CPIPE_CTL_IOCDESTROY, &index) < 0) {
+		perror("Failed to destroy pair");
+		goto out_close_ctl;
+	}
+	cpipe_delay();
+	if (end_exists(index, 0) || end_exists(index, 1)) {
+		fprintf(stderr, "Destroyed pair still exists\n");
+		goto out_close_ctl;
+	}
+	ret = 0;
+out_close_ctl:
+	close_ctl(ctl);
+	return ret;
+}
+
+static int test_closing_ctl_destroys_unused_pair(void)
+{
+	int ctl, fd;
+	unsigned int index;
+
+	if (create_pair(&ctl, &index))
+		return 1;
+	fd = open_end(index, 0, O_RDONLY | O_NONBLOCK);
+	if (fd < 0) {
+		close_ctl(ctl);
+		return 1;
+	}
+	/* the open end keeps it around */
+	close_ctl(ctl);
+	if (!end_exists(index, 0)) {
+		fprintf(stderr, "Pair destroyed while still open\n");
+		close(fd);
+		return 1;
+	}
+	close(fd);
+	cpipe_delay();
+	if (end_exists(index, 0)) {
+		fprintf(stderr, "Pair not destroyed after last close\n");
+		return 1;
+	}
+	return 0;
+}
+
+/* whether the child is still blocked after giving it time to get there */
+static int child_blocks(pid_t pid)
+{
+	int status;
+
+	usleep(100000);
+	return waitpid(pid, &status, WNOHANG) == 0;
+}
+
+static int child_succeeded(pid_t pid)
+{
+	int status;
+
+	if (waitpid(pid, &status, 0) != pid)
+		return 0;
+	return WIFEXITED(status) && !WEXITSTATUS(status);
+}
+
+static int test_lowat_blocking_and_poll(void)
+{
+	int ctl, rfd, wfd;
+	unsigned int index;
+	int size = 16, rlowat = 4, wlowat = 8;
+	char buf[16] = { 0 };
+	struct pollfd pfd;
+	pid_t pid;
+	int ret = 1;
+
+	if (create_pair(&ctl, &index))
+		return 1;
+	rfd = open_end(index, 0, O_RDONLY);
+	if (rfd < 0)
+		goto out_close_ctl;
+	if (ioctl(rfd, CPIPE_IOCSBSIZE, &size) < 0 ||
+			ioctl(rfd, CPIPE_IOCSRDLOWAT, &rlowat) < 0) {
+		perror("Failed to set up reader");
+		goto out_close_reader;
+	}
+	wfd = open_end(index, 1, O_WRONLY | O_NONBLOCK);
+	if (wfd < 0)
+		goto out_close_reader;
+	if (ioctl(wfd, CPIPE_IOCSWRLOWAT, &wlowat) < 0) {
+		perror("Failed to set up writer");
+		goto out_close_writer;
+	}
+	/* readers wait for rlowat bytes */
+	if (write(wfd, buf, rlowat - 1) != rlowat - 1)
+		goto out_close_writer;
+	pfd.fd = rfd;
+	pfd.events = POLLIN;
+	if (poll(&pfd, 1, 0) != 0) {
+		fprintf(stderr, "Readable below the read watermark\n");
+		goto out_close_writer;
+	}
+	pid = fork();
+	if (!pid)
+		_exit(read(rfd, buf, sizeof(buf)) != rlowat);
+	if (!child_blocks(pid)) {
+		fprintf(stderr, "Reader did not block below the watermark\n");
+		goto out_close_writer;
+	}
+	if (write(wfd, buf, 1) != 1 || !child_succeeded(pid)) {
+		fprintf(stderr, "Reader not woken up at the watermark\n");
+		goto out_close_writer;
+	}
+	/* writers wait for wlowat bytes of room */
+	if (write(wfd, buf, size - wlowat + 2) != size - wlowat + 2)
+		goto out_close_writer;
+	pfd.fd = wfd;
+	pfd.events = POLLOUT;
+	if (poll(&pfd, 1, 0) != 0) {
+		fprintf(stderr, "Writable below the write watermark\n");
+		goto out_close_writer;
+	}
+	if (write(wfd, buf, wlowat - 2) != wlowat - 2)
+		goto out_close_writer;
+	pid = fork();
+	if (!pid) {
+		fcntl(wfd, F_SETFL, 0);
+		_exit(write(wfd, buf, 1) != 1);
+	}
+	if (!child_blocks(pid)) {
+		fprintf(stderr, "Writer did not block on a full buffer\n");
+		goto out_close_writer;
+	}
+	if (read(rfd, buf, wlowat / 2) != wlowat / 2 || !child_blocks(pid)) {
+		fprintf(stderr, "Writer woken up below the watermark\n");
+		goto out_close_writer;
+	}
+	if (read(rfd, buf, wlowat / 2) != wlowat / 2 ||
+			!child_succeeded(pid)) {
+		fprintf(stderr, "Writer not woken up at the watermark\n");
+		goto out_close_writer;
+	}
+	ret = 0;
+out_close_writer:
+	close(wfd);
+out_close_reader:
+	close(rfd);
+out_close_ctl:
+	close_ctl(ctl);
+	return ret;
+}
+
+static int test_packet_rlowat_is_reachable(void)
+{
+	int ctl, rfd, wfd;
+	unsigned int index;
+	int size = 16, packet = 1;
+	char msg[] = "abcde";
+	struct pollfd pfd;
+	int ret = 1;
+
+	if (create_pair(&ctl, &index))
+		return 1;
+	rfd = open_end(index, 0, O_RDONLY | O_NONBLOCK);
+	if (rfd < 0)
+		goto out_close_ctl;
+	if (ioctl(rfd, CPIPE_IOCSBSIZE, &size) < 0 ||
+			ioctl(rfd, CPIPE_IOCSPACKET, &packet) < 0 ||
+			ioctl(rfd, CPIPE_IOCSRDLOWAT, &size) < 0) {
+		perror("Failed to set up reader");
+		goto out_close_reader;
+	}
+	wfd = open_end(index, 1, O_WRONLY | O_NONBLOCK);
+	if (wfd < 0)
+		goto out_close_reader;
+	/* fill it until the next message doesn't fit */
+	while (write(wfd, msg, strlen(msg)) == strlen(msg))
+		;
+	if (errno != EAGAIN) {
+		perror("Unexpected write error");
+		goto out_close_writer;
+	}
+	pfd.fd = rfd;
+	pfd.events = POLLIN;
+	if (poll(&pfd, 1, 0) != 1) {
+		fprintf(stderr, "Full packet buffer is not readable\n");
+		goto out_close_writer;
+	}
+	ret = 0;
+out_close_writer:
+	close(wfd);
+out_close_reader:
+	close(rfd);
+out_close_ctl:
+	close_ctl(ctl);
+	return ret;
+}
+
+static int test_bcast_cursors(void)
+{
+	int ctl, r1, r2, wfd;
+	unsigned int index;
+	int size = 16, bcast = CPIPE_BCAST_BLOCK;
+	int ret = 1;
+
+	if (spsc_mode())
+		return 0;
+	if (create_pair(&ctl, &index))
+		return 1;
+	r1 = open_end(index, 0, O_RDONLY | O_NONBLOCK);
+	if (r1 < 0)
+		goto out_close_ctl;
+	r2 = open_end(index, 0, O_RDONLY | O_NONBLOCK);
+	if (r2 < 0)
+		goto out_close_r1;
+	if (ioctl(r1, CPIPE_IOCSBSIZE, &size) < 0 ||
+			ioctl(r1, CPIPE_IOCSBCAST, &bcast) < 0) {
+		perror("Failed to set up broadcast");
+		goto out_close_r2;
+	}
+	wfd = open_end(index, 1, O_WRONLY | O_NONBLOCK);
+	if (wfd < 0)
+		goto out_close_r2;
+	if (write(wfd, "0123456789abcdef", 16) != 16)
+		goto out_close_writer;
+	/* every reader gets all of it, the slowest one holds it back */
+	if (read_expect(r1, "0123456789abcdef"))
+		goto out_close_writer;
+	if (write(wfd, "g", 1) >= 0 || errno != EAGAIN) {
+		fprintf(stderr, "Data dropped before all readers read it\n");
+		goto out_close_writer;
+	}
+	if (read_expect(r2, "01234567"))
+		goto out_close_writer;
+	if (write(wfd, "ghijklmn", 8) != 8) {
+		fprintf(stderr, "Room not freed by the slowest reader\n");
+		goto out_close_writer;
+	}
+	if (read_expect(r1, "ghijklmn") ||
+			read_expect(r2, "89abcdefghijklmn"))
+		goto out_close_writer;
+	/* overwriting drops the oldest data, and moves cursors past it */
+	bcast = CPIPE_BCAST_OVERWRITE;
+	if (ioctl(r1, CPIPE_IOCSBCAST, &bcast) < 0) {
+		perror("Failed to set overwrite mode");
+		goto out_close_writer;
+	}
+	if (write(wfd, "ABCDEFGHIJKLMNOP", 16) != 16 ||
+			read_expect(r1, "ABCD"))
+		goto out_close_writer;
+	if (write(wfd, "QRSTUVWX", 8) != 8) {
+		fprintf(stderr, "Overwriting writer did not make room\n");
+		goto out_close_writer;
+	}
+	if (read_expect(r1, "IJKLMNOPQRSTUVWX") ||
+			read_expect(r2, "IJKLMNOPQRSTUVWX"))
+		goto out_close_writer;
+	ret = 0;
+out_close_writer:
+	close(wfd);
+out_close_r2:
+	close(r2);
+out_close_r1:
+	close(r1);
+out_close_ctl:
+	close_ctl(ctl);
+	return ret;
+}
+
+static int test_forward(void)
+{
+	int actl, bctl, ar, aw, br, bw;
+	unsigned int aindex, bindex;
+	int stop = -1;
+	char c;
+	int ret = 1;
+
+	if (spsc_mode())
+		return 0;
+	if (create_pair(&actl, &aindex))
+		return 1;
+	if (create_pair(&bctl, &bindex))
+		goto out_close_actl;
+	ar = open_end(aindex, 0, O_RDONLY | O_NONBLOCK);
+	if (ar < 0)
+		goto out_close_bctl;
+	aw = open_end(aindex, 1, O_WRONLY | O_NONBLOCK);
+	if (aw < 0)
+		goto out_close_ar;
+	br = open_end(bindex, 0, O_RDONLY | O_NONBLOCK);
+	if (br < 0)
+		goto out_close_aw;
+	bw = open_end(bindex, 1, O_WRONLY | O_NONBLOCK);
+	if (bw < 0)
+		goto out_close_br;
+	if (ioctl(ar, CPIPE_IOCSFORWARD, &aw) >= 0 || errno != EINVAL) {
+		fprintf(stderr, "Forwarding a buffer to itself worked\n");
+		goto out_close_bw;
+	}
+	if (ioctl(ar, CPIPE_IOCSFORWARD, &bw) < 0) {
+		perror("Failed to forward");
+		goto out_close_bw;
+	}
+	if (ioctl(br, CPIPE_IOCSFORWARD, &aw) >= 0 || errno != ELOOP) {
+		fprintf(stderr, "Forwarding loop not detected\n");
+		goto out_close_bw;
+	}
+	if (write(aw, "hello", 5) != 5)
+		goto out_close_bw;
+	cpipe_delay();
+	if (read_expect(br, "hello"))
+		goto out_close_bw;
+	/* once stopped, data stays where it was written */
+	if (ioctl(ar, CPIPE_IOCSFORWARD, &stop) < 0) {
+		perror("Failed to stop forwarding");
+		goto out_close_bw;
+	}
+	if (write(aw, "world", 5) != 5)
+		goto out_close_bw;
+	cpipe_delay();
+	if (read(br, &c, 1) >= 0 || errno != EAGAIN) {
+		fprintf(stderr, "Data forwarded after stopping\n");
+		goto out_close_bw;
+	}
+	if (read_expect(ar, "world"))
+		goto out_close_bw;
+	ret = 0;
+out_close_bw:
+	close(bw);
+out_close_br:
+	close(br);
+out_close_aw:
+	close(aw);
+out_close_ar:
+	close(ar);
+out_close_bctl:
+	close_ctl(bctl);
+out_close_actl:
+	close_ctl(actl);
+	return ret;
+}
+
+struct single_test {
+	int (*test_fn)(void);
+	char *name;
+};
+
+#define test_entry(func)	\
+{	                        \
+	.test_fn = func,        \
+	.name = #func,          \
+}
+
+static struct single_test all_tests[] = {
+	test_entry(test_writev_stops_before_oversized_segment),
+	test_entry(test_pkthdr_reads_batch_messages),
+	test_entry(test_mmap_ring_exchange),
+	test_entry(test_resize_keeps_data),
+	test_entry(test_create_destroy_pair),
+	test_entry(test_closing_ctl_destroys_unused_pair),
+	test_entry(test_lowat_blocking_and_poll),
+	test_entry(test_packet_rlowat_is_reachable),
+	test_entry(test_bcast_cursors),
+	test_entry(test_forward),
+};
+
+int main(int argc, char *argv[])
+{
+	struct single_test *active;
+	int i, err, ret = 0;
+
+	for (i = 0; i < sizeof(all_tests) / sizeof((all_tests)[0]); i++) {
+		active = &all_tests[i];
+		dprintf(2, "%s: running test %s\n", argv[0], active->name);
+		err = active->test_fn();
+		if (err)
+			dprintf(2, "%s: test %s failed\n", argv[0],
+					active->name);
+		ret |= err;
+	}
+	return ret;
+}
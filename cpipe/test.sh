@@ -9,8 +9,10 @@ SLEEP_INTERVAL=1
 
 err=0
 cd $(dirname $0)
-insmod $MODULE.ko npipes=$NPIPES bsize=$BSIZE
-for pipe_num in $(seq 0 $(( NPIPES - 1 ))); do
+
+# $1 is the pipe number
+test_pipe() {
+	pipe_num=$1
 	pipe=/dev/${MODULE}$pipe_num
 	for end in 0 1; do
 		src=$pipe.$end
@@ -56,6 +58,28 @@ for pipe_num in $(seq 0 $(( NPIPES - 1 ))); do
 		fi
 		head -n 1 $snk > /dev/null
 	done
-done
-rmmod $MODULE
+	for end in 0 1; do
+		sysdir=/sys/class/$MODULE/${MODULE}$pipe_num.$end
+		for stat in bytes_read bytes_written; do
+			if [[ "$(cat $sysdir/$stat)" == "0" ]]; then
+				echo -n "$0: $stat of " 1>&2
+				echo "${MODULE}$pipe_num.$end is 0" 1>&2
+				err=1
+			fi
+		done
+	done
+}
+
+# $@ are extra module parameters
+run_tests() {
+	insmod $MODULE.ko npipes=$NPIPES bsize=$BSIZE "$@"
+	for pipe_num in $(seq 0 $(( NPIPES - 1 ))); do
+		test_pipe $pipe_num
+	done
+	./test.out || err=1
+	rmmod $MODULE
+}
+
+run_tests spsc=0
+run_tests spsc=1
 exit $err
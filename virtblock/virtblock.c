@@ -5,11 +5,16 @@
 #include <linux/fs.h>
 #include <linux/slab.h>
 #include <linux/vmalloc.h>
+#include <linux/highmem.h>
 #include <linux/genhd.h>
 #include <linux/blkdev.h>
+#include <linux/blk-mq.h>
 
 #include <lmod/meta.h>
 
+#define CREATE_TRACE_POINTS
+#include "virtblock_trace.h"
+
 #define VIRTBLOCK_MAGIC_NMINROS 16
 #define VIRTBLOCK_TO_BLK_LAYER (virtblock_hardsect_size / 512)
 
@@ -25,12 +30,26 @@ static int virtblock_hardsect_size = -1;
 module_param_named(hardsect_size, virtblock_hardsect_size, int, 0);
 MODULE_PARM_DESC(hardsect_size, "size of each sector in virtual disk");
 
+static int virtblock_nr_hw_queues;
+module_param_named(nr_hw_queues, virtblock_nr_hw_queues, int, 0);
+MODULE_PARM_DESC(nr_hw_queues, "number of hardware queues, 0 = one per cpu");
+
+static int virtblock_queue_depth = 128;
+module_param_named(queue_depth, virtblock_queue_depth, int, 0);
+MODULE_PARM_DESC(queue_depth, "number of requests per hardware queue");
+
+static bool virtblock_bio_based;
+module_param_named(bio_based, virtblock_bio_based, bool, 0);
+MODULE_PARM_DESC(bio_based, "serve bios directly, bypassing the request queue");
+
 struct virtblock_dev {
 	size_t size;
 	u8 *data;
-	spinlock_t lock;
+	struct blk_mq_tag_set tag_set;
 	struct request_queue *queue;
 	struct gendisk *gd;
+	/* log every request and segment, see the verbose attribute */
+	bool verbose;
 };
 
 static int virtblock_major;
@@ -97,58 +116,197 @@ static int virtblock_check_module_params(void)
 				virtblock_hardsect_size);
 		err = -EINVAL;
 	}
+	if (virtblock_nr_hw_queues < 0) {
+		pr_err("virtblock_nr_hw_queues < 0. value = %d\n",
+				virtblock_nr_hw_queues);
+		err = -EINVAL;
+	}
+	if (virtblock_queue_depth <= 0) {
+		pr_err("virtblock_queue_depth <= 0. value = %d\n",
+				virtblock_queue_depth);
+		err = -EINVAL;
+	}
 	return err;
 }
 
-static void virtblock_request(struct request_queue *q)
+/*
+ * copies a single segment from or to the device at offset. bios aren't
+ * bounced in bio_based mode, so the page may be in highmem.
+ */
+static void virtblock_transfer_segment(struct virtblock_dev *dev,
+		unsigned int write, unsigned int offset, struct bio_vec *bv)
+{
+	void *blkbuf; /* buffer received from the block layer */
+	void *devbuf; /* buffer received from our own device */
+
+	devbuf = dev->data + offset;
+	trace_virtblock_segment(dev->gd->disk_name, offset, bv->bv_len);
+	if (unlikely(READ_ONCE(dev->verbose)))
+		pr_info("%s: segment offset %u len %u\n",
+				dev->gd->disk_name, offset, bv->bv_len);
+	blkbuf = kmap_atomic(bv->bv_page);
+	if (write) /* write to device */
+		memcpy(devbuf, blkbuf + bv->bv_offset, bv->bv_len);
+	else /* read from device */
+		memcpy(blkbuf + bv->bv_offset, devbuf, bv->bv_len);
+	kunmap_atomic(blkbuf);
+}
+
+/*
+ * copies the data of req from or to the device. there is no lock, requests
+ * on different hardware queues are processed in parallel.
+ */
+static int virtblock_transfer(struct virtblock_dev *dev, struct request *req)
 {
-	struct request *req;
 	struct bio_vec bv;
 	struct req_iterator iter;
-	struct virtblock_dev *dev;
 	unsigned int write, nsect, offset;
 	sector_t sector;
 	size_t count;
-	void *blkbuf; /* buffer received from the block layer */
-	void *devbuf; /* buffer received from our own device */
 
-	while ((req = blk_fetch_request(q)) != NULL) {
-		dev = req->rq_disk->private_data;
-		if (req->cmd_type != REQ_TYPE_FS) {
-			pr_notice("skipping non-fs request\n");
-			__blk_end_request_all(req, -EIO);
-			continue;
-		}
-		write = rq_data_dir(req) == WRITE;
-		sector = blk_rq_pos(req);
-		do_div(sector, VIRTBLOCK_TO_BLK_LAYER);
-		nsect = blk_rq_sectors(req) / VIRTBLOCK_TO_BLK_LAYER;
-		pr_info("processing request %p\n", req);
-		pr_info("\tdevice %s\n", dev->gd->disk_name);
-		pr_info("\twrite %u\n", write);
-		pr_info("\tsector %lu\n", (unsigned long)sector);
-		pr_info("\tnsect %u\n", nsect);
-		offset = sector * virtblock_hardsect_size;
-		count = nsect * virtblock_hardsect_size;
-		if (offset + count > dev->size) {
-			pr_err("@%s offset + count > dev->size", __func__);
-			__blk_end_request_all(req, -EIO);
-		}
-		rq_for_each_segment(bv, req, iter) {
-			blkbuf = page_address(bv.bv_page) + bv.bv_offset;
-			devbuf = dev->data + offset;
-			pr_info("\tprocessing segment %p\n", blkbuf);
-			pr_info("\t\tlen %u\n", bv.bv_len);
-			if (write) /* write to device */
-				memcpy(devbuf, blkbuf, bv.bv_len);
-			else /* read from device */
-				memcpy(blkbuf, devbuf, bv.bv_len);
-			offset += bv.bv_len;
+	write = rq_data_dir(req) == WRITE;
+	sector = blk_rq_pos(req);
+	do_div(sector, VIRTBLOCK_TO_BLK_LAYER);
+	nsect = blk_rq_sectors(req) / VIRTBLOCK_TO_BLK_LAYER;
+	trace_virtblock_request(dev->gd->disk_name, req, write, sector, nsect);
+	if (unlikely(READ_ONCE(dev->verbose)))
+		pr_info("%s: request %p write %u sector %lu nsect %u\n",
+				dev->gd->disk_name, req, write,
+				(unsigned long)sector, nsect);
+	offset = sector * virtblock_hardsect_size;
+	count = nsect * virtblock_hardsect_size;
+	if (offset + count > dev->size) {
+		pr_err("@%s offset + count > dev->size", __func__);
+		return -EIO;
+	}
+	rq_for_each_segment(bv, req, iter) {
+		virtblock_transfer_segment(dev, write, offset, &bv);
+		offset += bv.bv_len;
+	}
+	return 0;
+}
+
+static int virtblock_queue_rq(struct blk_mq_hw_ctx *hctx,
+		const struct blk_mq_queue_data *bd)
+{
+	struct request *req = bd->rq;
+	struct virtblock_dev *dev = hctx->queue->queuedata;
+
+	blk_mq_start_request(req);
+	if (req->cmd_type != REQ_TYPE_FS) {
+		pr_notice("skipping non-fs request\n");
+		blk_mq_end_request(req, -EIO);
+		return BLK_MQ_RQ_QUEUE_OK;
+	}
+	blk_mq_end_request(req, virtblock_transfer(dev, req));
+	return BLK_MQ_RQ_QUEUE_OK;
+}
+
+static struct blk_mq_ops virtblock_mq_ops = {
+	.queue_rq = virtblock_queue_rq,
+};
+
+/*
+ * bio_based mode. bios are copied from the submitting context, with no
+ * request allocation, elevator or merging in between.
+ */
+static blk_qc_t virtblock_make_request(struct request_queue *q,
+		struct bio *bio)
+{
+	struct virtblock_dev *dev = q->queuedata;
+	struct bio_vec bv;
+	struct bvec_iter iter;
+	unsigned int write, offset;
+
+	write = bio_data_dir(bio) == WRITE;
+	trace_virtblock_bio(dev->gd->disk_name, bio, write,
+			bio->bi_iter.bi_sector, bio_sectors(bio));
+	if (unlikely(READ_ONCE(dev->verbose)))
+		pr_info("%s: bio %p write %u sector %lu nsect %u\n",
+				dev->gd->disk_name, bio, write,
+				(unsigned long)bio->bi_iter.bi_sector,
+				bio_sectors(bio));
+	if (bio_end_sector(bio) > get_capacity(dev->gd)) {
+		pr_err("@%s bio past the end of %s", __func__,
+				dev->gd->disk_name);
+		bio_io_error(bio);
+		return BLK_QC_T_NONE;
+	}
+	offset = bio->bi_iter.bi_sector << 9;
+	bio_for_each_segment(bv, bio, iter) {
+		virtblock_transfer_segment(dev, write, offset, &bv);
+		offset += bv.bv_len;
+	}
+	bio_endio(bio);
+	return BLK_QC_T_NONE;
+}
+
+static int __init virtblock_queue_create(struct virtblock_dev *dev)
+{
+	int err;
+
+	if (virtblock_bio_based) {
+		dev->queue = blk_alloc_queue(GFP_KERNEL);
+		if (!dev->queue) {
+			pr_err("blk_alloc_queue failed");
+			return -ENOMEM;
 		}
-		__blk_end_request_all(req, 0);
+		blk_queue_make_request(dev->queue, virtblock_make_request);
+		dev->queue->queuedata = dev;
+		return 0;
+	}
+	dev->tag_set.ops = &virtblock_mq_ops;
+	dev->tag_set.nr_hw_queues = virtblock_nr_hw_queues ?: nr_cpu_ids;
+	dev->tag_set.queue_depth = virtblock_queue_depth;
+	dev->tag_set.numa_node = NUMA_NO_NODE;
+	dev->tag_set.flags = BLK_MQ_F_SHOULD_MERGE;
+	dev->tag_set.driver_data = dev;
+	err = blk_mq_alloc_tag_set(&dev->tag_set);
+	if (err) {
+		pr_err("blk_mq_alloc_tag_set failed");
+		return err;
+	}
+	dev->queue = blk_mq_init_queue(&dev->tag_set);
+	if (IS_ERR(dev->queue)) {
+		err = PTR_ERR(dev->queue);
+		pr_err("blk_mq_init_queue failed");
+		blk_mq_free_tag_set(&dev->tag_set);
+		return err;
 	}
+	dev->queue->queuedata = dev;
+	return 0;
+}
+
+static void virtblock_queue_destroy(struct virtblock_dev *dev)
+{
+	blk_cleanup_queue(dev->queue);
+	if (!virtblock_bio_based)
+		blk_mq_free_tag_set(&dev->tag_set);
+}
+
+static ssize_t verbose_show(struct device *d,
+		struct device_attribute *attr, char *buf)
+{
+	struct virtblock_dev *dev = dev_to_disk(d)->private_data;
+
+	return sprintf(buf, "%d\n", READ_ONCE(dev->verbose));
 }
 
+static ssize_t verbose_store(struct device *d,
+		struct device_attribute *attr, const char *buf, size_t count)
+{
+	struct virtblock_dev *dev = dev_to_disk(d)->private_data;
+	bool verbose;
+	int err;
+
+	err = kstrtobool(buf, &verbose);
+	if (err)
+		return err;
+	WRITE_ONCE(dev->verbose, verbose);
+	return count;
+}
+static DEVICE_ATTR_RW(verbose);
+
 /* Note:
  * This function does not call add_disk(dev->gd) to allow the module to call
  it for all devices at once upon completion of initialization. this way the
@@ -168,13 +326,9 @@ static int __init virtblock_dev_setup(struct virtblock_dev *dev,
 		goto fail_vmalloc_devdata;
 	}
 	memset(dev->data, 0, dev->size);
-	spin_lock_init(&dev->lock);
-	dev->queue = blk_init_queue(virtblock_request, &dev->lock);
-	if (!dev->queue) {
-		err = -ENOMEM;
-		pr_err("blk_init_queue failed");
-		goto fail_blk_init_queue;
-	}
+	err = virtblock_queue_create(dev);
+	if (err)
+		goto fail_virtblock_queue_create;
 	blk_queue_logical_block_size(dev->queue, virtblock_hardsect_size);
 	dev->gd = alloc_disk(VIRTBLOCK_MAGIC_NMINROS);
 	if (!dev->gd) {
@@ -193,8 +347,8 @@ static int __init virtblock_dev_setup(struct virtblock_dev *dev,
 	pr_info("initialized device %s successfully\n", dev->gd->disk_name);
 	return 0;
 fail_alloc_disk:
-	blk_cleanup_queue(dev->queue);
-fail_blk_init_queue:
+	virtblock_queue_destroy(dev);
+fail_virtblock_queue_create:
 	vfree(dev->data);
 fail_vmalloc_devdata:
 	return err;
@@ -203,8 +357,10 @@ fail_vmalloc_devdata:
 static void virtblock_dev_cleanup(struct virtblock_dev *dev)
 {
 	pr_info("cleaning up device %s\n", dev->gd->disk_name);
+	/* fine if it was never created */
+	device_remove_file(disk_to_dev(dev->gd), &dev_attr_verbose);
 	del_gendisk(dev->gd);
-	blk_cleanup_queue(dev->queue);
+	virtblock_queue_destroy(dev);
 	vfree(dev->data);
 }
 
@@ -247,8 +403,20 @@ static int __init virtblock_init(void)
 	 */
 	for (i = 0; i < virtblock_ndevices; i++)
 		add_disk(virtblock_devices[i].gd);
+	for (i = 0; i < virtblock_ndevices; i++) {
+		err = device_create_file(disk_to_dev(virtblock_devices[i].gd),
+				&dev_attr_verbose);
+		if (err) {
+			pr_err("device_create_file failed. i = %d, err = %d\n",
+					i, err);
+			goto fail_device_create_file;
+		}
+	}
 	pr_info("initialized successfully\n");
 	return 0;
+fail_device_create_file:
+	/* all devices are set up by now */
+	i = virtblock_ndevices;
 fail_virtblock_dev_setup_loop:
 	/* device at [i] isn't initialized */
 	while (i--)
@@ -278,4 +446,4 @@ module_exit(virtblock_exit)
 LMOD_MODULE_AUTHOR();
 LMOD_MODULE_LICENSE();
 MODULE_DESCRIPTION("A simple block device residing in ram");
-MODULE_VERSION("1.0.5");
+MODULE_VERSION("1.3.0");
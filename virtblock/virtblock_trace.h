@@ -0,0 +1,81 @@
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM virtblock
+
+#if !defined(_VIRTBLOCK_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _VIRTBLOCK_TRACE_H
+
+#include <linux/tracepoint.h>
+
+TRACE_EVENT(virtblock_request,
+	TP_PROTO(const char *disk, struct request *req, unsigned int write,
+			sector_t sector, unsigned int nsect),
+	TP_ARGS(disk, req, write, sector, nsect),
+	TP_STRUCT__entry(
+		__string(disk, disk)
+		__field(struct request *, req)
+		__field(unsigned int, write)
+		__field(sector_t, sector)
+		__field(unsigned int, nsect)
+	),
+	TP_fast_assign(
+		__assign_str(disk, disk);
+		__entry->req = req;
+		__entry->write = write;
+		__entry->sector = sector;
+		__entry->nsect = nsect;
+	),
+	TP_printk("%s req=%p write=%u sector=%llu nsect=%u",
+			__get_str(disk), __entry->req, __entry->write,
+			(unsigned long long)__entry->sector, __entry->nsect)
+);
+
+/* bio_based mode, sectors are in 512 byte units here */
+TRACE_EVENT(virtblock_bio,
+	TP_PROTO(const char *disk, struct bio *bio, unsigned int write,
+			sector_t sector, unsigned int nsect),
+	TP_ARGS(disk, bio, write, sector, nsect),
+	TP_STRUCT__entry(
+		__string(disk, disk)
+		__field(struct bio *, bio)
+		__field(unsigned int, write)
+		__field(sector_t, sector)
+		__field(unsigned int, nsect)
+	),
+	TP_fast_assign(
+		__assign_str(disk, disk);
+		__entry->bio = bio;
+		__entry->write = write;
+		__entry->sector = sector;
+		__entry->nsect = nsect;
+	),
+	TP_printk("%s bio=%p write=%u sector=%llu nsect=%u",
+			__get_str(disk), __entry->bio, __entry->write,
+			(unsigned long long)__entry->sector, __entry->nsect)
+);
+
+/* offset is in bytes from the start of the device */
+TRACE_EVENT(virtblock_segment,
+	TP_PROTO(const char *disk, unsigned int offset, unsigned int len),
+	TP_ARGS(disk, offset, len),
+	TP_STRUCT__entry(
+		__string(disk, disk)
+		__field(unsigned int, offset)
+		__field(unsigned int, len)
+	),
+	TP_fast_assign(
+		__assign_str(disk, disk);
+		__entry->offset = offset;
+		__entry->len = len;
+	),
+	TP_printk("%s offset=%u len=%u", __get_str(disk), __entry->offset,
+			__entry->len)
+);
+
+#endif /* _VIRTBLOCK_TRACE_H */
+
+/* this header lives next to the module, not in include/trace/events */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE virtblock_trace
+#include <trace/define_trace.h>